@@ -0,0 +1,228 @@
+// Firmware build for machines with a planogram fixed at build time.
+// Self-contained: no Product hierarchy, no heap allocation, no virtual dispatch and no
+// iostream, so it links into a small binary. Build the VendingFirmware target, or
+//   g++ -std=c++14 -Os Firmware.cpp -o vending_firmware
+#include <cstddef>
+#include <cstdio>
+#include <ctime>
+
+using namespace std;
+
+// Product kinds for the compile-time catalog; mirrors the Product class hierarchy in Main.cpp
+enum ProductKind : unsigned char {
+    PRODUCT_GENERAL,
+    PRODUCT_DISCOUNTED,
+    PRODUCT_BEVERAGE,
+    PRODUCT_LIMITED_TIME
+};
+
+// One planogram entry as written in firmware source. Only the fields of its kind are used.
+struct StaticProductSpec {
+    const char* name;
+    ProductKind kind;
+    double basePrice;
+    int stockQuantity;
+    double discount;      // PRODUCT_DISCOUNTED
+    bool isCarbonated;    // PRODUCT_BEVERAGE
+    double volume;        // PRODUCT_BEVERAGE, in liters
+    double specialPrice;  // PRODUCT_LIMITED_TIME
+    int daysValid;        // PRODUCT_LIMITED_TIME
+};
+
+// Categories of the built-in product types; same ids and names as CategoryRegistry
+enum StaticCategory : unsigned char {
+    STATIC_GENERAL,
+    STATIC_DISCOUNTED,
+    STATIC_CARBONATED_BEVERAGE,
+    STATIC_NON_CARBONATED_BEVERAGE,
+    STATIC_LIMITED_TIME
+};
+
+const char* const staticCategoryNames[] = {
+    "General Product",
+    "Discounted Item",
+    "Carbonated Beverage",
+    "Non-carbonated Beverage",
+    "Limited Time Offer"
+};
+
+// constexpr builders applying the same validation as the Product constructors
+constexpr StaticProductSpec staticProduct(const char* name, double basePrice, int stockQuantity) {
+    return StaticProductSpec{name, PRODUCT_GENERAL, basePrice, stockQuantity, 0, false, 0, 0, 0};
+}
+
+constexpr StaticProductSpec staticDiscounted(const char* name, double basePrice, int stockQuantity, double discount) {
+    return StaticProductSpec{name, PRODUCT_DISCOUNTED, basePrice, stockQuantity,
+                             discount >= 0 && discount <= 100 ? discount : 0, false, 0, 0, 0};
+}
+
+constexpr StaticProductSpec staticBeverage(const char* name, double basePrice, int stockQuantity,
+                                           bool isCarbonated, double volume) {
+    return StaticProductSpec{name, PRODUCT_BEVERAGE, basePrice, stockQuantity, 0,
+                             isCarbonated, volume > 0 ? volume : 0, 0, 0};
+}
+
+constexpr StaticProductSpec staticLimitedTime(const char* name, double basePrice, int stockQuantity,
+                                              double specialPrice, int daysValid) {
+    return StaticProductSpec{name, PRODUCT_LIMITED_TIME, basePrice, stockQuantity, 0, false, 0,
+                             specialPrice >= 0 ? specialPrice : basePrice, daysValid > 0 ? daysValid : 0};
+}
+
+// Statically laid-out catalog table. Every price rule of the class hierarchy is folded in
+// at compile time: activePrice applies while an offer runs, expiredPrice afterwards.
+template <size_t N>
+struct StaticCatalogTable {
+    const char* name[N];
+    double basePrice[N];
+    double activePrice[N];
+    double expiredPrice[N];
+    long long offerSeconds[N];  // -1 = the offer never expires
+    int initialStock[N];
+    bool sellable[N];      // false for beverages with no volume, like Beverage::isAvailable
+    StaticCategory category[N];
+};
+
+template <size_t N>
+constexpr StaticCatalogTable<N> buildStaticCatalogTable(const StaticProductSpec (&specs)[N]) {
+    StaticCatalogTable<N> table{};
+    for (size_t i = 0; i < N; ++i) {
+        const StaticProductSpec& spec = specs[i];
+        table.name[i] = spec.name;
+        table.basePrice[i] = spec.basePrice;
+        table.initialStock[i] = spec.stockQuantity;
+        table.sellable[i] = true;
+        table.offerSeconds[i] = -1;
+        switch (spec.kind) {
+            case PRODUCT_DISCOUNTED:
+                table.activePrice[i] = spec.basePrice * (1 - spec.discount / 100);
+                table.category[i] = STATIC_DISCOUNTED;
+                break;
+            case PRODUCT_BEVERAGE:
+                table.activePrice[i] = spec.isCarbonated ? spec.basePrice * 1.1 : spec.basePrice;
+                table.category[i] = spec.isCarbonated ? STATIC_CARBONATED_BEVERAGE : STATIC_NON_CARBONATED_BEVERAGE;
+                table.sellable[i] = spec.volume > 0;
+                break;
+            case PRODUCT_LIMITED_TIME:
+                table.activePrice[i] = spec.specialPrice;
+                table.category[i] = STATIC_LIMITED_TIME;
+                table.offerSeconds[i] = static_cast<long long>(spec.daysValid) * 24 * 60 * 60;
+                break;
+            default:
+                table.activePrice[i] = spec.basePrice;
+                table.category[i] = STATIC_GENERAL;
+                break;
+        }
+        table.expiredPrice[i] = spec.kind == PRODUCT_LIMITED_TIME ? spec.basePrice : table.activePrice[i];
+    }
+    return table;
+}
+
+// Static catalog class - fixed planogram with no heap and no virtual dispatch.
+// Only the stock counters and boot time live in mutable memory.
+template <size_t N>
+class StaticCatalog {
+private:
+    const StaticCatalogTable<N>& table;
+    int stock[N];
+    time_t bootTime;
+
+    bool offerRunning(size_t index, time_t now) const {
+        return table.offerSeconds[index] < 0 || now < bootTime + table.offerSeconds[index];
+    }
+
+public:
+    explicit StaticCatalog(const StaticCatalogTable<N>& table) : table(table), bootTime(time(0)) {
+        for (size_t i = 0; i < N; ++i) {
+            stock[i] = table.initialStock[i];
+        }
+    }
+
+    size_t size() const { return N; }
+
+    double calculatePrice(size_t index) const {
+        return offerRunning(index, time(0)) ? table.activePrice[index] : table.expiredPrice[index];
+    }
+
+    // Same contract as the Product overrides: limited offers stop selling once expired
+    bool isAvailable(size_t index) const {
+        return stock[index] > 0 && table.sellable[index] && offerRunning(index, time(0));
+    }
+
+    // Same semantics as Product::purchase
+    bool purchase(size_t index, int quantity) {
+        if (quantity <= 0) return false;
+
+        if (quantity <= stock[index]) {
+            stock[index] -= quantity;
+            return true;
+        }
+        printf("Sorry, not enough %s in stock. Available: %d\n", table.name[index], stock[index]);
+        return false;
+    }
+
+    void displayProducts() const {
+        for (size_t i = 0; i < N; ++i) {
+            printf("%u. %s (%s)\n  Price: $%.2f\n  Stock: %d\n   Status: %s\n\n",
+                   static_cast<unsigned>(i + 1), table.name[i], staticCategoryNames[table.category[i]],
+                   calculatePrice(i), stock[i], isAvailable(i) ? "Available" : "Unavailable");
+        }
+    }
+};
+
+// Fixed planogram for low-end machines; the price table below is computed by the compiler
+constexpr StaticProductSpec firmwarePlanogram[] = {
+    staticDiscounted("Lays Chips", 2.50, 10, 15),
+    staticBeverage("Coca Cola", 2.00, 12, true, 0.33),
+    staticDiscounted("Protein Bar", 3.50, 8, 10),
+    staticBeverage("Mineral Water", 1.50, 15, false, 0.5),
+    staticBeverage("Monster Energy", 3.50, 10, true, 0.473),
+    staticLimitedTime("Special Snack", 5.00, 5, 3.99, 7)
+};
+
+constexpr StaticCatalogTable<sizeof(firmwarePlanogram) / sizeof(firmwarePlanogram[0])> firmwareCatalog =
+    buildStaticCatalogTable(firmwarePlanogram);
+
+static_assert(firmwareCatalog.category[1] == STATIC_CARBONATED_BEVERAGE, "carbonated drinks resolve at compile time");
+static_assert(firmwareCatalog.activePrice[1] > firmwareCatalog.basePrice[1], "carbonated premium is applied");
+static_assert(firmwareCatalog.activePrice[0] < firmwareCatalog.basePrice[0], "discount is applied");
+static_assert(firmwareCatalog.offerSeconds[5] == 7 * 24 * 60 * 60, "offer length is computed in seconds");
+
+// Interactive vending over the compile-time catalog
+int main() {
+    static StaticCatalog<sizeof(firmwarePlanogram) / sizeof(firmwarePlanogram[0])> catalog(firmwareCatalog);
+
+    printf("\n=== Welcome to Smart Vending (firmware) ===\n\n");
+    catalog.displayProducts();
+
+    double total = 0.0;
+    char continueChoice = 'n';
+    do {
+        int choice = 0;
+        printf("Enter product number (1-%u): ", static_cast<unsigned>(catalog.size()));
+        if (scanf("%d", &choice) != 1) break;
+
+        if (choice >= 1 && choice <= static_cast<int>(catalog.size())) {
+            size_t index = choice - 1;
+            if (!catalog.isAvailable(index)) {
+                printf("Product currently unavailable.\n");
+            } else {
+                int quantity = 0;
+                printf("Enter quantity: ");
+                if (scanf("%d", &quantity) != 1) break;
+                if (catalog.purchase(index, quantity)) {
+                    double itemTotal = catalog.calculatePrice(index) * quantity;
+                    total += itemTotal;
+                    printf("Subtotal: $%.2f\n", itemTotal);
+                }
+            }
+        } else {
+            printf("Invalid selection.\n");
+        }
+
+        printf("Select another product? (y/n): ");
+        if (scanf(" %c", &continueChoice) != 1) break;
+    } while (continueChoice == 'y' || continueChoice == 'Y');
+
+    printf("\nTotal amount: $%.2f\n", total);
+    return 0;
+}
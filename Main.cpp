@@ -3,10 +3,88 @@
 #include <vector>
 #include <iomanip>
 #include <cstdlib>
+#include <cmath>
 #include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <deque>
+#include <new>
+#include <unordered_set>
+#include <fstream>
+#include <cstdio>
+#include <memory>
+#include <condition_variable>
+#include <queue>
+#include <set>
 
 using namespace std;
 
+// Allocation counter class - counts global operator new calls while enabled.
+// Used by --alloc-check to prove the purchase path does not allocate after catalog load.
+class AllocationCounter {
+private:
+    static atomic<bool> enabled;
+    static atomic<long> allocations;
+
+public:
+    static void start() {
+        allocations.store(0);
+        enabled.store(true);
+    }
+
+    static long stop() {
+        enabled.store(false);
+        return allocations.load();
+    }
+
+    static void onAllocate() {
+        if (enabled.load(memory_order_relaxed)) {
+            allocations.fetch_add(1, memory_order_relaxed);
+        }
+    }
+};
+
+atomic<bool> AllocationCounter::enabled(false);
+atomic<long> AllocationCounter::allocations(0);
+
+void* operator new(size_t size) {
+    AllocationCounter::onAllocate();
+    void* memory = malloc(size > 0 ? size : 1);
+    if (memory == nullptr) throw bad_alloc();
+    return memory;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+// Kept out of line so GCC does not pair the inlined free() with the builtin operator new
+#if defined(__GNUC__)
+#define VENDING_NOINLINE __attribute__((noinline))
+#else
+#define VENDING_NOINLINE
+#endif
+
+VENDING_NOINLINE void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+VENDING_NOINLINE void operator delete[](void* memory) noexcept {
+    free(memory);
+}
+
+VENDING_NOINLINE void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+VENDING_NOINLINE void operator delete[](void* memory, size_t) noexcept {
+    free(memory);
+}
+
 // Price calculator class - handles all price-related calculations
 class PriceCalculator {
 public:
@@ -41,35 +119,173 @@ public:
     }
 };
 
+// Clock class - the current time as seen by offers, analytics, pricing and the machine.
+// Real time by default; the discrete-event simulation sets a virtual time and moves it
+// forward itself.
+class Clock {
+private:
+    static atomic<time_t> virtualNow;  // 0 = real time
+
+public:
+    static time_t now() {
+        time_t simulated = virtualNow.load(memory_order_relaxed);
+        return simulated != 0 ? simulated : time(0);
+    }
+
+    static void setVirtualTime(time_t now) {
+        if (now > 0) {  // Added validation
+            virtualNow.store(now, memory_order_relaxed);
+        }
+    }
+
+    static void useRealTime() {
+        virtualNow.store(0, memory_order_relaxed);
+    }
+};
+
+atomic<time_t> Clock::virtualNow(0);
+
+// Built-in product categories. Ids are fixed at compile time so grouping and filtering
+// by category is an integer compare; display names live in CategoryRegistry.
+enum CategoryId : unsigned short {
+    CATEGORY_GENERAL,
+    CATEGORY_DISCOUNTED,
+    CATEGORY_CARBONATED_BEVERAGE,
+    CATEGORY_NON_CARBONATED_BEVERAGE,
+    CATEGORY_LIMITED_TIME,
+    CATEGORY_BUILTIN_COUNT
+};
+
+// Category registry class - maps category ids to display names
+class CategoryRegistry {
+private:
+    // deque keeps references returned by getName valid while new categories are added
+    static deque<string>& names() {
+        static deque<string> registered = {
+            "General Product",
+            "Discounted Item",
+            "Carbonated Beverage",
+            "Non-carbonated Beverage",
+            "Limited Time Offer"
+        };
+        return registered;
+    }
+
+    static mutex& registryMutex() {
+        static mutex registryLock;
+        return registryLock;
+    }
+
+public:
+    static const string& getName(CategoryId id) {
+        const deque<string>& registered = names();
+        return id < registered.size() ? registered[id] : registered[CATEGORY_GENERAL];
+    }
+
+    // Interns a runtime category name (e.g. from a catalog file). Register categories while
+    // loading the catalog, before purchase threads start reading names.
+    static CategoryId registerCategory(const string& name) {
+        lock_guard<mutex> lock(registryMutex());
+        deque<string>& registered = names();
+        for (size_t i = 0; i < registered.size(); ++i) {
+            if (registered[i] == name) return static_cast<CategoryId>(i);
+        }
+        registered.push_back(name);
+        return static_cast<CategoryId>(registered.size() - 1);
+    }
+
+    static size_t count() {
+        return names().size();
+    }
+};
+
+// Name arena class - interns product names so identical names share one copy.
+// Interned strings are never freed or moved, so products can keep a plain pointer.
+class NameArena {
+private:
+    static unordered_set<string>& names() {
+        static unordered_set<string> interned;  // node-based: element addresses survive rehashing
+        return interned;
+    }
+
+    static mutex& arenaMutex() {
+        static mutex arenaLock;
+        return arenaLock;
+    }
+
+    static size_t& internRequests() {
+        static size_t requests = 0;
+        return requests;
+    }
+
+public:
+    static const string* intern(const string& name) {
+        lock_guard<mutex> lock(arenaMutex());
+        internRequests()++;
+        return &*names().insert(name).first;
+    }
+
+    static size_t uniqueNames() {
+        lock_guard<mutex> lock(arenaMutex());
+        return names().size();
+    }
+
+    // Characters actually stored vs. what one string per product would have needed
+    static void displayStats() {
+        lock_guard<mutex> lock(arenaMutex());
+        size_t bytes = 0;
+        for (const auto& name : names()) {
+            bytes += name.size();
+        }
+        cout << "Name arena: " << names().size() << " unique names for "
+             << internRequests() << " products (" << bytes << " bytes of text)" << endl;
+    }
+};
+
 // Abstract Base Product class implementing core functionality
 class Product {
 protected:
-    string name;
+    const string* internedName;  // shared copy owned by NameArena
     double basePrice;  // Renamed from price to basePrice to better reflect its role
     int stockQuantity;
 
 public:
-    Product() : name("Unknown"), basePrice(0.0), stockQuantity(0) {}
-    Product(string name, double basePrice) : name(name), basePrice(basePrice), stockQuantity(0) {}
-    Product(string name, double basePrice, int stockQuantity)
-        : name(name), basePrice(basePrice), stockQuantity(stockQuantity) {}
+    Product() : internedName(NameArena::intern("Unknown")), basePrice(0.0), stockQuantity(0) {}
+    Product(const string& name, double basePrice)
+        : internedName(NameArena::intern(name)), basePrice(basePrice), stockQuantity(0) {}
+    Product(const string& name, double basePrice, int stockQuantity)
+        : internedName(NameArena::intern(name)), basePrice(basePrice), stockQuantity(stockQuantity) {}
 
     // Modified to ensure LSP compliance - all derived classes must be able to display info
     virtual void displayInfo() const {
-        cout << "Product: " << name
-             << "\n  Base Price: $" << fixed << setprecision(2) << basePrice
-             << "\n  Final Price: $" << calculatePrice()
+        displayInfoAt(basePrice);
+    }
+
+    // Displays the product priced from the given base price (e.g. from a published price table)
+    virtual void displayInfoAt(double base) const {
+        cout << "Product: " << getName()
+             << "\n  Base Price: $" << fixed << setprecision(2) << base
+             << "\n  Final Price: $" << calculatePriceAt(base)
              << "\n  Stock: " << stockQuantity << endl;
     }
 
     // Modified to ensure LSP compliance - base calculation that derived classes can extend
     virtual double calculatePrice() const {
-        return basePrice;
+        return calculatePriceAt(basePrice);
+    }
+
+    // The pricing rule of this product type applied to the given base price
+    virtual double calculatePriceAt(double base) const {
+        return base;
     }
 
     // Modified to return a base category that derived classes can specialize
-    virtual string getCategory() const {
-        return "General Product";
+    virtual CategoryId getCategoryId() const {
+        return CATEGORY_GENERAL;
+    }
+
+    const string& getCategory() const {
+        return CategoryRegistry::getName(getCategoryId());
     }
 
     // Modified to ensure LSP compliance - all derived classes must maintain this contract
@@ -77,7 +293,18 @@ public:
         return stockQuantity > 0;
     }
 
-    // Function Overloading - different ways to update price
+    // True once a time-limited product can no longer be sold
+    virtual bool hasExpired() const {
+        return false;
+    }
+
+    // When a time-limited product stops selling; 0 for products that never expire
+    virtual time_t getExpiryTime() const {
+        return 0;
+    }
+
+    // Function Overloading - different ways to update price. Only for products not yet added
+    // to a VendingMachine; slots are repriced with VendingMachine::updateProductPrice.
     virtual void updatePrice(double newPrice) {
         if (newPrice >= 0) {  // Added validation to ensure LSP
             basePrice = newPrice;
@@ -100,16 +327,27 @@ public:
     virtual bool purchase(int quantity) {
         if (quantity <= 0) return false;  // Added validation
 
+        if (tryPurchase(quantity)) {
+            return true;
+        }
+        cout << "Sorry, not enough " << getName() << " in stock. Available: " << stockQuantity << endl;
+        return false;
+    }
+
+    // Stock check and decrement without console output; VendingMachine reports failures itself
+    bool tryPurchase(int quantity) {
+        if (quantity <= 0) return false;  // Added validation
+
         if (InventoryManager::checkAvailability(quantity, stockQuantity)) {
             stockQuantity = InventoryManager::updateStock(stockQuantity, quantity, false);
             return true;
         }
-        cout << "Sorry, not enough " << name << " in stock. Available: " << stockQuantity << endl;
         return false;
     }
 
     double getBasePrice() const { return basePrice; }
-    string getName() const { return name; }
+    int getStockQuantity() const { return stockQuantity; }
+    const string& getName() const { return *internedName; }
 
     // Operator Overloading for stock management - modified to ensure LSP compliance
     Product& operator+=(int quantity) {
@@ -135,23 +373,23 @@ private:
     double discount;
 
 public:
-    DiscountedProduct(string name, double basePrice, int stockQuantity, double discount)
+    DiscountedProduct(const string& name, double basePrice, int stockQuantity, double discount)
         : Product(name, basePrice, stockQuantity), discount(discount >= 0 && discount <= 100 ? discount : 0) {}
 
-    void displayInfo() const override {
-        cout << "Discounted Product: " << name
-             << "\n  Original Price: $" << fixed << setprecision(2) << basePrice
+    void displayInfoAt(double base) const override {
+        cout << "Discounted Product: " << getName()
+             << "\n  Original Price: $" << fixed << setprecision(2) << base
              << "\n  Discount: " << discount << "%"
-             << "\n  Final Price: $" << calculatePrice()
+             << "\n  Final Price: $" << calculatePriceAt(base)
              << "\n  Stock: " << stockQuantity << endl;
     }
 
-    double calculatePrice() const override {
-        return PriceCalculator::calculateDiscountedPrice(basePrice, discount);
+    double calculatePriceAt(double base) const override {
+        return PriceCalculator::calculateDiscountedPrice(base, discount);
     }
 
-    string getCategory() const override {
-        return "Discounted Item";
+    CategoryId getCategoryId() const override {
+        return CATEGORY_DISCOUNTED;
     }
 };
 
@@ -162,25 +400,25 @@ private:
     double volume;  // in liters
 
 public:
-    Beverage(string name, double basePrice, int stockQuantity, bool isCarbonated, double volume)
+    Beverage(const string& name, double basePrice, int stockQuantity, bool isCarbonated, double volume)
         : Product(name, basePrice, stockQuantity),
           isCarbonated(isCarbonated),
           volume(volume > 0 ? volume : 0) {}  // Added validation
 
-    void displayInfo() const override {
-        cout << "Beverage: " << name
-             << "\n  Price: $" << fixed << setprecision(2) << calculatePrice()
+    void displayInfoAt(double base) const override {
+        cout << "Beverage: " << getName()
+             << "\n  Price: $" << fixed << setprecision(2) << calculatePriceAt(base)
              << "\n  Volume: " << volume << "L"
              << "\n  Type: " << (isCarbonated ? "Carbonated" : "Non-carbonated")
              << "\n  Stock: " << stockQuantity << endl;
     }
 
-    double calculatePrice() const override {
-        return isCarbonated ? basePrice * 1.1 : basePrice;  // 10% premium for carbonated drinks
+    double calculatePriceAt(double base) const override {
+        return isCarbonated ? base * 1.1 : base;  // 10% premium for carbonated drinks
     }
 
-    string getCategory() const override {
-        return isCarbonated ? "Carbonated Beverage" : "Non-carbonated Beverage";
+    CategoryId getCategoryId() const override {
+        return isCarbonated ? CATEGORY_CARBONATED_BEVERAGE : CATEGORY_NON_CARBONATED_BEVERAGE;
     }
 
     bool isAvailable() const override {
@@ -207,151 +445,6776 @@ private:
     double specialPrice;
 
 public:
-    LimitedTimeProduct(string name, double basePrice, int stockQuantity,
+    LimitedTimeProduct(const string& name, double basePrice, int stockQuantity,
                       double specialPrice, int daysValid)
         : Product(name, basePrice, stockQuantity),
           specialPrice(specialPrice >= 0 ? specialPrice : basePrice),  // Added validation
-          expiryDate(time(0) + (daysValid > 0 ? daysValid * 24 * 60 * 60 : 0)) {}  // Added validation
+          expiryDate(Clock::now() + (daysValid > 0 ? daysValid * 24 * 60 * 60 : 0)) {}  // Added validation
 
-    void displayInfo() const override {
-        time_t now = time(0);
+    void displayInfoAt(double base) const override {
+        time_t now = Clock::now();
         int daysLeft = (expiryDate - now) / (24 * 60 * 60);
 
-        cout << "Limited Time Product: " << name
-             << "\n  Regular Price: $" << fixed << setprecision(2) << basePrice
-             << "\n  Special Price: $" << calculatePrice()
+        cout << "Limited Time Product: " << getName()
+             << "\n  Regular Price: $" << fixed << setprecision(2) << base
+             << "\n  Special Price: $" << calculatePriceAt(base)
              << "\n  Days Left: " << daysLeft
              << "\n  Stock: " << stockQuantity << endl;
     }
 
-    double calculatePrice() const override {
-        time_t now = time(0);
-        return now < expiryDate ? specialPrice : basePrice;
+    double calculatePriceAt(double base) const override {
+        time_t now = Clock::now();
+        return now < expiryDate ? specialPrice : base;
     }
 
-    string getCategory() const override {
-        return "Limited Time Offer";
+    CategoryId getCategoryId() const override {
+        return CATEGORY_LIMITED_TIME;
     }
 
     bool isAvailable() const override {
-        return Product::isAvailable() && time(0) < expiryDate;
+        return Product::isAvailable() && Clock::now() < expiryDate;
+    }
+
+    bool hasExpired() const override {
+        return Clock::now() >= expiryDate;
+    }
+
+    time_t getExpiryTime() const override {
+        return expiryDate;
     }
 };
 
-// Sales tracker class
-class SalesTracker {
+// RCU domain class - epoch-based read-copy-update for data read on the purchase path.
+// Readers publish the epoch they entered in a per-thread slot and never lock; writers
+// publish a new version, advance the epoch, and free old versions once every reader
+// that could still hold them has left its read section.
+class RcuDomain {
+public:
+    static const int MAX_READERS = 256;
+
 private:
-    static double totalSales;
-    static int totalTransactions;
+    struct alignas(64) ReaderSlot {  // one cache line per reader, no false sharing
+        atomic<unsigned long> epoch;  // 0 = not inside a read section
+        atomic<bool> claimed;
+    };
+
+    struct ThreadState {
+        int slot = -1;
+        int depth = 0;
+
+        ~ThreadState() {
+            if (slot >= 0) {
+                slots()[slot].claimed.store(false);
+            }
+        }
+    };
+
+    static ReaderSlot* slots() {
+        static ReaderSlot readerSlots[MAX_READERS];
+        return readerSlots;
+    }
+
+    static atomic<unsigned long>& globalEpoch() {
+        static atomic<unsigned long> epoch(1);
+        return epoch;
+    }
+
+    static ThreadState& threadState() {
+        thread_local ThreadState state;
+        return state;
+    }
+
+    // Slots are claimed once per thread; with more live threads than slots, wait for one
+    static int claimSlot() {
+        while (true) {
+            for (int i = 0; i < MAX_READERS; ++i) {
+                bool expected = false;
+                if (!slots()[i].claimed.load(memory_order_relaxed) &&
+                    slots()[i].claimed.compare_exchange_strong(expected, true)) {
+                    return i;
+                }
+            }
+            this_thread::yield();
+        }
+    }
 
 public:
-    static void recordSale(double amount) {
-        if (amount > 0) {  // Added validation
-            totalSales += amount;
-            totalTransactions++;
+    static void readLock() {
+        ThreadState& state = threadState();
+        if (state.depth++ > 0) return;  // nested read sections share the outer epoch
+        if (state.slot < 0) {
+            state.slot = claimSlot();
         }
+        slots()[state.slot].epoch.store(globalEpoch().load());
     }
 
-    static void displayTotalSales() {
-        cout << "Total Sales: $" << fixed << setprecision(2) << totalSales << endl;
+    static void readUnlock() {
+        ThreadState& state = threadState();
+        if (--state.depth == 0) {
+            slots()[state.slot].epoch.store(0, memory_order_release);
+        }
     }
 
-    static void displayTransactionStats() {
-        cout << "Total Transactions: " << totalTransactions << endl;
+    // Called by a writer right after unpublishing an object; returns the epoch every
+    // reader must have moved past before that object can be freed
+    static unsigned long advanceEpoch() {
+        return globalEpoch().fetch_add(1) + 1;
+    }
+
+    static bool readersPast(unsigned long epoch) {
+        for (int i = 0; i < MAX_READERS; ++i) {
+            unsigned long readerEpoch = slots()[i].epoch.load();
+            if (readerEpoch != 0 && readerEpoch < epoch) return false;
+        }
+        return true;
     }
 };
 
-double SalesTracker::totalSales = 0.0;
-int SalesTracker::totalTransactions = 0;
+// Scoped RCU read section
+class RcuReadGuard {
+public:
+    RcuReadGuard() { RcuDomain::readLock(); }
+    ~RcuReadGuard() { RcuDomain::readUnlock(); }
 
-// VendingMachine class manages the product inventory
-class VendingMachine {
+    RcuReadGuard(const RcuReadGuard&) = delete;
+    RcuReadGuard& operator=(const RcuReadGuard&) = delete;
+};
+
+// One version of a machine's base prices, indexed like its product slots. Published entries
+// never change; slots added to the machine are appended in spare capacity and become
+// visible to readers through slotCount.
+struct PriceTable {
+    unsigned long version;
+    vector<double> basePrices;
+    atomic<size_t> slotCount;
+
+    PriceTable(unsigned long version, vector<double> prices)
+        : version(version), basePrices(move(prices)), slotCount(basePrices.size()) {}
+};
+
+// Price table manager class - versioned price tables published with RCU.
+// A whole repricing becomes visible at once; readers never block or see a mix of versions.
+class PriceTableManager {
 private:
-    string name;
-    vector<Product*> products;
+    atomic<PriceTable*> current;
+    mutex writerMutex;
+    vector<pair<PriceTable*, unsigned long>> retired;  // old table + epoch readers must pass
+
+    void publishLocked(vector<double> basePrices) {
+        PriceTable* previous = current.load();
+        PriceTable* next = new PriceTable(previous != nullptr ? previous->version + 1 : 1, move(basePrices));
+        current.store(next);
+        if (previous != nullptr) {
+            retired.push_back(make_pair(previous, RcuDomain::advanceEpoch()));
+        }
+        reclaimRetired();
+    }
+
+    void reclaimRetired() {
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); ++i) {
+            if (RcuDomain::readersPast(retired[i].second)) {
+                delete retired[i].first;
+            } else {
+                retired[kept++] = retired[i];
+            }
+        }
+        retired.resize(kept);
+    }
 
 public:
-    VendingMachine(string name) : name(name) {}
+    PriceTableManager() : current(nullptr) {}
 
-    void addProduct(Product* product) {
-        if (product != nullptr) {  // Added validation
-            products.push_back(product);
-            cout << "Added " << product->getName()
-                 << " (" << product->getCategory() << ")" << endl;
+    PriceTableManager(const PriceTableManager&) = delete;
+    PriceTableManager& operator=(const PriceTableManager&) = delete;
+
+    // Only valid inside an RcuReadGuard; may return nullptr before the first publish or append
+    const PriceTable* read() const {
+        return current.load();
+    }
+
+    void publish(vector<double> basePrices) {
+        lock_guard<mutex> lock(writerMutex);
+        publishLocked(move(basePrices));
+    }
+
+    // Adds a slot to the current version. Fills spare capacity in place, so readers of the
+    // existing slots are not disturbed; a full table is republished with double the room.
+    void append(double basePrice) {
+        lock_guard<mutex> lock(writerMutex);
+        PriceTable* table = current.load();
+        if (table != nullptr && table->basePrices.size() < table->basePrices.capacity()) {
+            table->basePrices.push_back(basePrice);  // never reallocates, readers only index
+            table->slotCount.store(table->basePrices.size());
+            return;
+        }
+        vector<double> grown;
+        size_t count = table != nullptr ? table->slotCount.load() : 0;
+        grown.reserve(max<size_t>(16, 2 * count));
+        if (table != nullptr) {
+            grown.assign(table->basePrices.begin(), table->basePrices.begin() + count);
         }
+        grown.push_back(basePrice);
+        publishLocked(move(grown));
     }
 
-    void displayProducts() const {
-        cout << "\nProducts in " << name << ":\n" << endl;
-        for (size_t i = 0; i < products.size(); ++i) {
-            cout << i + 1 << ". ";
-            products[i]->displayInfo();
-            cout << "   Status: " << (products[i]->isAvailable() ? "Available" : "Unavailable")
-                 << "\n" << endl;
+    // Frees retired versions no reader can still see; publish() also does this
+    void reclaim() {
+        lock_guard<mutex> lock(writerMutex);
+        reclaimRetired();
+    }
+
+    size_t pendingReclaim() {
+        lock_guard<mutex> lock(writerMutex);
+        return retired.size();
+    }
+
+    ~PriceTableManager() {
+        for (auto& entry : retired) {
+            delete entry.first;
         }
+        delete current.load();
     }
+};
 
-    double selectProducts() {
-        double total = 0.0;
-        char continueChoice;
-        bool purchaseMade = false;
+// Lock-free single-producer/single-consumer ring buffer. Exactly one thread may push and
+// exactly one (other) thread may pop. Capacity is rounded up to a power of two.
+template <typename T>
+class SpscQueue {
+private:
+    vector<T> buffer;
+    size_t mask;
+    // head and tail sit on separate cache lines (padding instead of alignas: C++14 heap
+    // allocations do not honor extended alignment)
+    char leadingPadding[64];
+    atomic<size_t> head;  // next slot to pop, written by the consumer
+    char headPadding[64];
+    atomic<size_t> tail;  // next slot to push, written by the producer
+    char tailPadding[64];
 
-        do {
-            int choice;
-            cout << "Enter product number (1-" << products.size() << "): ";
-            cin >> choice;
+public:
+    explicit SpscQueue(size_t capacity) : head(0), tail(0) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        buffer.resize(size);
+        mask = size - 1;
+    }
 
-            if (choice < 1 || choice > static_cast<int>(products.size())) {
-                cout << "Invalid selection." << endl;
-                continue;
-            }
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
 
-            if (!products[choice - 1]->isAvailable()) {
-                cout << "Product currently unavailable." << endl;
+    bool tryPush(const T& item) {
+        size_t position = tail.load(memory_order_relaxed);
+        if (position - head.load(memory_order_acquire) > mask) return false;  // full
+        buffer[position & mask] = item;
+        tail.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& item) {
+        size_t position = head.load(memory_order_relaxed);
+        if (position == tail.load(memory_order_acquire)) return false;  // empty
+        item = buffer[position & mask];
+        head.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+    }
+
+    // Items pushed since the queue was created
+    size_t pushedCount() const {
+        return tail.load(memory_order_acquire);
+    }
+};
+
+enum ReceiptEventType {
+    RECEIPT_OUT_OF_STOCK,
+    RECEIPT_SUBTOTAL,
+    RECEIPT_PROMOTION,
+    RECEIPT_PROMOTION_SAVINGS,
+    RECEIPT_CHECKOUT
+};
+
+// Structured receipt/log record. Strings are referenced, not copied: product names are
+// interned by NameArena and promotion names live as long as their PromotionEngine.
+struct ReceiptEvent {
+    ReceiptEventType type;
+    const string* productName;
+    const string* detail;
+    int quantity;
+    int available;
+    double amount;
+};
+
+// Receipt printer class - formats receipts and logs on a background thread.
+// Each transaction thread gets its own SPSC queue, so enqueuing never locks and never
+// waits for the console. If a queue is full the event is dropped and counted.
+class ReceiptPrinter {
+public:
+    static const int MAX_PRODUCERS = 64;
+
+private:
+    struct Producer {
+        SpscQueue<ReceiptEvent> queue;
+        thread::id owner;
+        atomic<size_t> printed;  // events of this queue written and flushed, drain thread only
+
+        Producer(size_t capacity, thread::id owner) : queue(capacity), owner(owner), printed(0) {}
+    };
+
+    ostream& out;
+    size_t queueCapacity;
+    const unsigned long long instanceId;  // never reused, unlike the printer's address
+    atomic<Producer*> producers[MAX_PRODUCERS];
+    atomic<int> producerCount;
+    mutex registrationMutex;
+    atomic<bool> running;
+    atomic<long> dropped;
+    thread worker;
+
+    static unsigned long long nextInstanceId() {
+        static atomic<unsigned long long> next(1);
+        return next.fetch_add(1);
+    }
+
+    void drainLoop() {
+        ReceiptEvent event;
+        size_t printed[MAX_PRODUCERS] = {};
+        int idleRounds = 0;
+        while (true) {
+            bool stopping = !running.load();
+            bool printedAny = false;
+            int count = producerCount.load();
+            for (int i = 0; i < count; ++i) {
+                Producer* producer = producers[i].load();
+                while (producer->queue.tryPop(event)) {
+                    format(out, event);
+                    printed[i]++;
+                    printedAny = true;
+                }
+            }
+            if (printedAny) {
+                out.flush();
+                for (int i = 0; i < count; ++i) {
+                    producers[i].load()->printed.store(printed[i]);  // only now visible to flush()
+                }
+                idleRounds = 0;
                 continue;
             }
+            if (stopping) return;
+            // Back off while idle; the transaction threads never wait for this thread
+            if (++idleRounds < 64) {
+                this_thread::yield();
+            } else {
+                this_thread::sleep_for(chrono::microseconds(200));
+            }
+        }
+    }
 
-            int quantity;
-            cout << "Enter quantity: ";
-            cin >> quantity;
+    // The calling thread's queue, created on its first event
+    SpscQueue<ReceiptEvent>* producerQueue() {
+        thread::id self = this_thread::get_id();
+        lock_guard<mutex> lock(registrationMutex);
+        int count = producerCount.load();
+        for (int i = 0; i < count; ++i) {
+            if (producers[i].load()->owner == self) return &producers[i].load()->queue;
+        }
+        if (count >= MAX_PRODUCERS) return nullptr;
+        producers[count].store(new Producer(queueCapacity, self));
+        producerCount.store(count + 1);
+        return &producers[count].load()->queue;
+    }
 
-            if (products[choice - 1]->purchase(quantity)) {
-                double itemTotal = products[choice - 1]->calculatePrice() * quantity;
-                total += itemTotal;
-                purchaseMade = true;
-                cout << "Subtotal: $" << fixed << setprecision(2) << itemTotal << endl;
-            }
+public:
+    explicit ReceiptPrinter(ostream& out, size_t queueCapacity = 4096)
+        : out(out), queueCapacity(queueCapacity), instanceId(nextInstanceId()), producerCount(0),
+          running(true), dropped(0) {
+        worker = thread(&ReceiptPrinter::drainLoop, this);
+    }
 
-            cout << "Select another product? (y/n): ";
-            cin >> continueChoice;
-        } while (continueChoice == 'y' || continueChoice == 'Y');
+    ReceiptPrinter(const ReceiptPrinter&) = delete;
+    ReceiptPrinter& operator=(const ReceiptPrinter&) = delete;
 
-        if (purchaseMade) {
-            SalesTracker::recordSale(total);
+    // Called from a transaction thread; the first call on each thread creates its queue.
+    // The thread caches its queue for the last printer it used, keyed by instance id.
+    void enqueue(const ReceiptEvent& event) {
+        thread_local unsigned long long cachedPrinter = 0;
+        thread_local SpscQueue<ReceiptEvent>* queue = nullptr;
+        if (cachedPrinter != instanceId) {
+            cachedPrinter = instanceId;
+            queue = producerQueue();
+        }
+        if (queue == nullptr || !queue->tryPush(event)) {
+            dropped.fetch_add(1, memory_order_relaxed);
         }
+    }
 
-        return total;
+    // Waits until everything enqueued so far has been written (e.g. before an interactive prompt)
+    void flush() {
+        size_t enqueued[MAX_PRODUCERS];
+        int count = producerCount.load();
+        for (int i = 0; i < count; ++i) {
+            enqueued[i] = producers[i].load()->queue.pushedCount();
+        }
+        for (int i = 0; i < count; ++i) {
+            while (producers[i].load()->printed.load() < enqueued[i]) {
+                this_thread::yield();
+            }
+        }
     }
 
-    ~VendingMachine() {
-        for (auto product : products) {
-            delete product;
+    long droppedEvents() const {
+        return dropped.load();
+    }
+
+    static void format(ostream& out, const ReceiptEvent& event) {
+        switch (event.type) {
+            case RECEIPT_OUT_OF_STOCK:
+                out << "Sorry, not enough " << *event.productName << " in stock. Available: " << event.available << "\n";
+                break;
+            case RECEIPT_SUBTOTAL:
+                out << "Subtotal: $" << fixed << setprecision(2) << event.amount << "\n";
+                break;
+            case RECEIPT_PROMOTION:
+                out << "Promotion applied to " << *event.productName << ": " << *event.detail << "\n";
+                break;
+            case RECEIPT_PROMOTION_SAVINGS:
+                out << "Promotion savings: -$" << fixed << setprecision(2) << event.amount << "\n";
+                break;
+            case RECEIPT_CHECKOUT:
+                out << "Receipt: " << event.quantity << " items, total $" << fixed << setprecision(2)
+                    << event.amount << "\n";
+                break;
+        }
+    }
+
+    ~ReceiptPrinter() {
+        running.store(false);
+        worker.join();
+        for (int i = 0; i < producerCount.load(); ++i) {
+            delete producers[i].load();
         }
     }
 };
 
-int main() {
-    VendingMachine* machine = new VendingMachine("Smart Vending");
+enum SalesEventType : unsigned char {
+    SALES_EVENT_SALE,      // one successful basket line
+    SALES_EVENT_RESTOCK,
+    SALES_EVENT_EXPIRY,    // a limited-time offer ran out
+    SALES_EVENT_CHECKOUT,  // a finished basket; amount is the basket total after promotions
+    SALES_EVENT_RELEASE    // reserved units back on sale after a declined payment
+};
 
-    // Adding regular products
-    machine->addProduct(new DiscountedProduct("Lays Chips", 2.50, 10, 15));        // 15% off
-    machine->addProduct(new Beverage("Coca Cola", 2.00, 12, true, 0.33));          // carbonated, 330ml
-    machine->addProduct(new DiscountedProduct("Protein Bar", 3.50, 8, 10));        // 10% off
-    machine->addProduct(new Beverage("Mineral Water", 1.50, 15, false, 0.5));      // non-carbonated, 500ml
-    machine->addProduct(new Beverage("Monster Energy", 3.50, 10, true, 0.473));    // carbonated, 473ml
+// Checkout events carry the item count in quantity and the number of distinct products in product
+struct SalesEvent {
+    SalesEventType type;
+    CategoryId category;
+    int quantity;
+    int stockAfter;
+    size_t product;
+    double amount;
+    time_t timestamp;
+    unsigned long long customer;  // checkout only; 0 = anonymous
+};
 
-    // Adding a new type of product (Limited Time Offer)
-    machine->addProduct(new LimitedTimeProduct("Special Snack", 5.00, 5, 3.99, 7)); // 7-day offer
+// Sales event consumer interface - receives events in batches on the bus thread
+class SalesEventConsumer {
+public:
+    virtual void onEvents(const SalesEvent* events, size_t count) = 0;
+    virtual ~SalesEventConsumer() {}
+};
+
+// Sales event bus class - bounded multi-producer/single-consumer queue of sale, restock,
+// release, expiry and checkout events. Producers claim a slot with a single fetch_add; each slot has
+// a sequence number (Vyukov-style) so the consumer knows when it is filled. When the ring
+// is full, publish() waits for the consumer (backpressure) and tryPublish() fails instead.
+// A background thread drains events in batches and hands each batch to every consumer.
+class SalesEventBus {
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        SalesEvent event;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    size_t maxBatch;
+    char leadingPadding[64];
+    atomic<size_t> tail;  // next slot to claim, shared by producers
+    char tailPadding[64];
+    size_t head;          // next slot to drain, consumer thread only
+    vector<SalesEvent> batch;
+    vector<SalesEventConsumer*> consumers;
+    atomic<bool> running;
+    atomic<size_t> drained;  // events fully delivered to consumers
+    atomic<long> batches;
+    atomic<long> backpressureWaits;
+    thread worker;
+
+    size_t drainBatch() {
+        size_t count = 0;
+        while (count < maxBatch) {
+            Cell& cell = cells[head & mask];
+            if (cell.sequence.load(memory_order_acquire) != head + 1) break;  // not published yet
+            batch[count++] = cell.event;
+            cell.sequence.store(head + mask + 1, memory_order_release);      // free for the next lap
+            head++;
+        }
+        if (count > 0) {
+            for (SalesEventConsumer* consumer : consumers) {
+                consumer->onEvents(batch.data(), count);
+            }
+            batches.fetch_add(1, memory_order_relaxed);
+            drained.store(head, memory_order_release);
+        }
+        return count;
+    }
+
+    void drainLoop() {
+        int idleRounds = 0;
+        while (true) {
+            if (drainBatch() > 0) {
+                idleRounds = 0;
+                continue;
+            }
+            if (!running.load()) {
+                if (head == tail.load()) return;
+                continue;  // a producer claimed a slot but has not filled it yet
+            }
+            if (++idleRounds < 64) {
+                this_thread::yield();
+            } else {
+                this_thread::sleep_for(chrono::microseconds(100));
+            }
+        }
+    }
+
+public:
+    // Consumers are fixed at construction so the hot path never synchronizes on the list
+    SalesEventBus(const vector<SalesEventConsumer*>& consumers, size_t capacity = 1 << 16, size_t maxBatch = 256)
+        : maxBatch(maxBatch > 0 ? maxBatch : 1), tail(0), head(0), batch(this->maxBatch),
+          consumers(consumers), running(true), drained(0), batches(0), backpressureWaits(0) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i);
+        }
+        worker = thread(&SalesEventBus::drainLoop, this);
+    }
+
+    SalesEventBus(const SalesEventBus&) = delete;
+    SalesEventBus& operator=(const SalesEventBus&) = delete;
+
+    void publish(const SalesEvent& event) {
+        size_t position = tail.fetch_add(1, memory_order_relaxed);
+        Cell& cell = cells[position & mask];
+        if (cell.sequence.load(memory_order_acquire) != position) {
+            backpressureWaits.fetch_add(1, memory_order_relaxed);
+            while (cell.sequence.load(memory_order_acquire) != position) {
+                this_thread::yield();
+            }
+        }
+        cell.event = event;
+        cell.sequence.store(position + 1, memory_order_release);
+    }
+
+    // Non-blocking variant for callers that would rather shed the event than wait
+    bool tryPublish(const SalesEvent& event) {
+        size_t position = tail.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            if (cell.sequence.load(memory_order_acquire) != position) {
+                size_t current = tail.load(memory_order_relaxed);
+                if (current == position) return false;  // full
+                position = current;
+                continue;
+            }
+            if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                cell.event = event;
+                cell.sequence.store(position + 1, memory_order_release);
+                return true;
+            }
+        }
+    }
+
+    // Waits until every event published before this call has reached the consumers
+    void flush() {
+        size_t target = tail.load();
+        while (drained.load(memory_order_acquire) < target) {
+            this_thread::yield();
+        }
+    }
+
+    void displayStats() const {
+        size_t delivered = drained.load();
+        long batchCount = batches.load();
+        cout << "Event bus: " << delivered << " events in " << batchCount << " batches (avg "
+             << fixed << setprecision(1) << (batchCount > 0 ? static_cast<double>(delivered) / batchCount : 0.0)
+             << "), " << backpressureWaits.load() << " producer waits on a full ring" << endl;
+    }
+
+    ~SalesEventBus() {
+        running.store(false);
+        worker.join();
+    }
+};
+
+// Sales tracker class
+class SalesTracker {
+private:
+    static double totalSales;
+    static int totalTransactions;
+    static mutex salesMutex;  // recordSale may be called from several purchase threads
+
+public:
+    static void recordSale(double amount) {
+        if (amount > 0) {  // Added validation
+            lock_guard<mutex> lock(salesMutex);
+            totalSales += amount;
+            totalTransactions++;
+        }
+    }
+
+    static void displayTotalSales() {
+        cout << "Total Sales: $" << fixed << setprecision(2) << totalSales << endl;
+    }
+
+    static void displayTransactionStats() {
+        cout << "Total Transactions: " << totalTransactions << endl;
+    }
+};
+
+double SalesTracker::totalSales = 0.0;
+int SalesTracker::totalTransactions = 0;
+mutex SalesTracker::salesMutex;
+
+// Feeds checkout events from a SalesEventBus into SalesTracker
+class SalesTrackerConsumer : public SalesEventConsumer {
+public:
+    void onEvents(const SalesEvent* events, size_t count) override {
+        for (size_t i = 0; i < count; ++i) {
+            if (events[i].type == SALES_EVENT_CHECKOUT) {
+                SalesTracker::recordSale(events[i].amount);
+            }
+        }
+    }
+};
+
+// T-digest class - mergeable quantile sketch. Values are buffered, then folded into at most
+// about `compression` weighted centroids, kept small at the tails and larger in the middle,
+// so extreme quantiles stay accurate. All storage is reserved up front: adding and merging
+// never allocate.
+class TDigest {
+private:
+    struct Centroid {
+        double mean;
+        double weight;
+        bool operator<(const Centroid& other) const { return mean < other.mean; }
+    };
+
+    double compression;
+    vector<Centroid> centroids;
+    vector<Centroid> buffer;   // unmerged values
+    vector<Centroid> scratch;
+    size_t bufferLimit;
+    double totalWeight;
+    double minimum;
+    double maximum;
+
+    // Scale function k1: centroid size limits shrink towards q = 0 and q = 1
+    double kOfQ(double q) const { return compression / (2 * M_PI) * asin(2 * q - 1); }
+    double qOfK(double k) const {
+        return k >= compression / 4 ? 1.0 : (sin(k * 2 * M_PI / compression) + 1) / 2;
+    }
+
+    void push(double mean, double weight) {
+        if (weight <= 0) return;
+        buffer.push_back(Centroid{mean, weight});
+        totalWeight += weight;
+        minimum = min(minimum, mean);
+        maximum = max(maximum, mean);
+        if (buffer.size() >= bufferLimit) {
+            compress();
+        }
+    }
+
+public:
+    TDigest(double compression = 100)
+        : compression(compression), bufferLimit(static_cast<size_t>(10 * compression)),
+          totalWeight(0), minimum(HUGE_VAL), maximum(-HUGE_VAL) {
+        size_t centroidLimit = static_cast<size_t>(2 * compression) + 8;
+        centroids.reserve(centroidLimit);
+        buffer.reserve(bufferLimit);
+        scratch.reserve(centroidLimit + bufferLimit);
+    }
+
+    void add(double value) { push(value, 1.0); }
+
+    // Folds the buffer into the centroids
+    void compress() {
+        if (buffer.empty()) return;
+        sort(buffer.begin(), buffer.end());  // centroids are already in order
+        scratch.resize(centroids.size() + buffer.size());
+        std::merge(centroids.begin(), centroids.end(), buffer.begin(), buffer.end(), scratch.begin());
+        buffer.clear();
+
+        centroids.clear();
+        Centroid current = scratch[0];
+        double weightSoFar = 0;
+        double limit = totalWeight * qOfK(kOfQ(0) + 1);
+        for (size_t i = 1; i < scratch.size(); ++i) {
+            if (weightSoFar + current.weight + scratch[i].weight <= limit) {
+                current.weight += scratch[i].weight;
+                current.mean += (scratch[i].mean - current.mean) * scratch[i].weight / current.weight;
+            } else {
+                centroids.push_back(current);
+                weightSoFar += current.weight;
+                limit = totalWeight * qOfK(kOfQ(weightSoFar / totalWeight) + 1);
+                current = scratch[i];
+            }
+        }
+        centroids.push_back(current);
+    }
+
+    // Adds another digest's distribution to this one; other is left unchanged
+    void merge(const TDigest& other) {
+        for (const Centroid& c : other.centroids) push(c.mean, c.weight);
+        for (const Centroid& c : other.buffer) push(c.mean, c.weight);
+    }
+
+    double count() const { return totalWeight; }
+
+    // Estimated value at quantile q in [0, 1]; 0 when empty
+    double quantile(double q) {
+        compress();
+        if (centroids.empty()) return 0.0;
+        if (centroids.size() == 1) return centroids[0].mean;
+        q = min(1.0, max(0.0, q));
+        double target = q * totalWeight;
+
+        // Interpolate between centroid centers; the ends run out to the observed min and max
+        double center = centroids[0].weight / 2;
+        if (target < center) {
+            return minimum + (centroids[0].mean - minimum) * target / center;
+        }
+        for (size_t i = 0; i + 1 < centroids.size(); ++i) {
+            double nextCenter = center + (centroids[i].weight + centroids[i + 1].weight) / 2;
+            if (target <= nextCenter) {
+                return centroids[i].mean +
+                       (centroids[i + 1].mean - centroids[i].mean) * (target - center) / (nextCenter - center);
+            }
+            center = nextCenter;
+        }
+        double tail = totalWeight - center;
+        return centroids.back().mean + (maximum - centroids.back().mean) * (target - center) / max(tail, 1e-12);
+    }
+};
+
+// HyperLogLog class - distinct-count sketch in 2^precision one-byte registers (4 KB by
+// default, about 1.6% standard error). Merging takes the register-wise maximum, so sketches
+// from different machines combine into the fleet-wide distinct count.
+class HyperLogLog {
+private:
+    int precision;
+    vector<unsigned char> registers;
+
+    static unsigned long long mix(unsigned long long x) {  // splitmix64 finalizer
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+public:
+    HyperLogLog(int precision = 12) : precision(precision), registers(size_t(1) << precision, 0) {}
+
+    void add(unsigned long long key) {
+        unsigned long long hash = mix(key);
+        size_t index = hash >> (64 - precision);
+        unsigned long long rest = (hash << precision) | (1ULL << (precision - 1));  // guard bit caps the rank
+        unsigned char rank = static_cast<unsigned char>(__builtin_clzll(rest) + 1);
+        if (rank > registers[index]) registers[index] = rank;
+    }
+
+    // Sketches must use the same precision
+    void merge(const HyperLogLog& other) {
+        if (other.precision != precision) return;  // Added validation
+        for (size_t i = 0; i < registers.size(); ++i) {
+            registers[i] = max(registers[i], other.registers[i]);
+        }
+    }
+
+    double estimate() const {
+        double m = static_cast<double>(registers.size());
+        double sum = 0;
+        size_t zeros = 0;
+        for (unsigned char r : registers) {
+            sum += ldexp(1.0, -r);
+            if (r == 0) zeros++;
+        }
+        double raw = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (raw <= 2.5 * m && zeros > 0) {
+            return m * log(m / zeros);  // linear counting for small cardinalities
+        }
+        return raw;
+    }
+};
+
+// Sales sketches class - per-machine basket statistics that merge across a fleet without
+// moving raw sales: basket value and distinct products per basket as t-digests, distinct
+// customers as a HyperLogLog. Fed from checkout alongside SalesTracker::recordSale.
+// Purchase threads record into their own shard, so checkout never waits on another
+// thread's sketch update; shards are merged when a report is taken.
+class SalesSketches : public SalesEventConsumer {
+private:
+    struct Sketches {
+        TDigest basketValues;
+        TDigest basketBreadth;  // distinct products per basket
+        HyperLogLog customers;
+
+        void merge(const Sketches& other) {
+            basketValues.merge(other.basketValues);
+            basketBreadth.merge(other.basketBreadth);
+            customers.merge(other.customers);
+        }
+    };
+
+    struct Shard {
+        mutex shardMutex;
+        Sketches sketches;
+        char padding[64];  // keeps neighbouring shard locks off this cache line
+    };
+
+    static const size_t SHARD_COUNT = 16;
+    vector<Shard> shards;  // sized once; shards never move
+
+    static size_t threadShard() {
+        static atomic<size_t> nextShard(0);
+        thread_local size_t shard = nextShard.fetch_add(1) % SHARD_COUNT;
+        return shard;
+    }
+
+    // Snapshot of all shards merged into one set of sketches
+    void collect(Sketches& total) {
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            lock_guard<mutex> lock(shards[i].shardMutex);
+            total.merge(shards[i].sketches);
+        }
+    }
+
+public:
+    SalesSketches() : shards(SHARD_COUNT) {}
+
+    // customer 0 is an anonymous purchase and is not counted as a distinct customer
+    void recordBasket(double amount, int distinctProducts, unsigned long long customer) {
+        Shard& shard = shards[threadShard()];
+        lock_guard<mutex> lock(shard.shardMutex);
+        shard.sketches.basketValues.add(amount);
+        shard.sketches.basketBreadth.add(distinctProducts);
+        if (customer != 0) {
+            shard.sketches.customers.add(customer);
+        }
+    }
+
+    void onEvents(const SalesEvent* events, size_t count) override {
+        for (size_t i = 0; i < count; ++i) {
+            if (events[i].type == SALES_EVENT_CHECKOUT) {
+                recordBasket(events[i].amount, static_cast<int>(events[i].product), events[i].customer);
+            }
+        }
+    }
+
+    // Folds another machine's sketches into this one (e.g. at the regional aggregator)
+    void merge(SalesSketches& other) {
+        if (&other == this) return;
+        Sketches incoming;
+        other.collect(incoming);
+        Shard& shard = shards[threadShard()];
+        lock_guard<mutex> lock(shard.shardMutex);
+        shard.sketches.merge(incoming);
+    }
+
+    void displayReport() {
+        Sketches total;
+        collect(total);
+        cout << fixed << setprecision(2)
+             << "Basket value p50/p90/p99: $" << total.basketValues.quantile(0.5) << " / $"
+             << total.basketValues.quantile(0.9) << " / $" << total.basketValues.quantile(0.99)
+             << " (" << static_cast<long>(total.basketValues.count()) << " baskets)" << endl;
+        cout << setprecision(1) << "Distinct products per basket p50/p90/p99: " << total.basketBreadth.quantile(0.5)
+             << " / " << total.basketBreadth.quantile(0.9) << " / " << total.basketBreadth.quantile(0.99) << endl;
+        cout << setprecision(0) << "Distinct customers (estimated): " << total.customers.estimate() << endl;
+    }
+};
+
+// Sales analytics class - columnar per-product and per-category revenue/units in time buckets.
+// Each product (and category) owns one contiguous column of bucketCount slots used as a ring,
+// so the window queries below are plain strided-free loops the compiler can vectorize.
+// Category columns roll over eagerly; a product column is only cleared when that product
+// next sells, so a bucket rollover costs O(categories) however large the catalog is.
+class SalesAnalytics : public SalesEventConsumer {
+private:
+    int bucketSeconds;
+    size_t bucketCount;
+    long long currentBucket;       // absolute bucket number held by the newest slot, -1 before first sale
+    bool productColumns;           // false: categories only, product queries answer 0
+
+    vector<double> productRevenue;  // [product * bucketCount + slot]
+    vector<int> productUnits;
+    vector<long long> productBucket;     // newest bucket each product column holds, -1 while still zeroed
+    vector<CategoryId> productCategory;  // product -> category column
+    size_t categoryCount;
+    vector<double> categoryRevenue; // [category * bucketCount + slot]
+    vector<int> categoryUnits;
+    mutable mutex analyticsMutex;
+
+    size_t slotOf(long long bucket) const {
+        return static_cast<size_t>(bucket % static_cast<long long>(bucketCount));
+    }
+
+    static void clearSlot(vector<double>& revenue, vector<int>& units, size_t columns,
+                          size_t bucketCount, size_t slot) {
+        for (size_t column = 0; column < columns; ++column) {
+            revenue[column * bucketCount + slot] = 0.0;
+            units[column * bucketCount + slot] = 0;
+        }
+    }
+
+    // Moves the ring forward to bucket, clearing the category slots that fall out of the
+    // window. The columns start zeroed, so the first sale clears nothing.
+    void advanceTo(long long bucket) {
+        if (currentBucket < 0) {
+            currentBucket = bucket;
+            return;
+        }
+        if (bucket <= currentBucket) return;
+
+        long long first = max(currentBucket + 1, bucket - static_cast<long long>(bucketCount) + 1);
+        for (long long b = first; b <= bucket; ++b) {
+            clearSlot(categoryRevenue, categoryUnits, categoryCount, bucketCount, slotOf(b));
+        }
+        currentBucket = bucket;
+    }
+
+    // The same for one product column, clearing its slots from its newest bucket up to bucket
+    void advanceProduct(size_t product, long long bucket) {
+        long long& newest = productBucket[product];
+        if (newest < 0) {
+            newest = bucket;
+            return;
+        }
+        if (bucket <= newest) return;
+
+        long long first = max(newest + 1, bucket - static_cast<long long>(bucketCount) + 1);
+        for (long long b = first; b <= bucket; ++b) {
+            productRevenue[product * bucketCount + slotOf(b)] = 0.0;
+            productUnits[product * bucketCount + slotOf(b)] = 0;
+        }
+        newest = bucket;
+    }
+
+    void ensureCategoryColumns(size_t count) {
+        if (count <= categoryCount) return;
+        categoryCount = count;
+        categoryRevenue.resize(categoryCount * bucketCount, 0.0);
+        categoryUnits.resize(categoryCount * bucketCount, 0);
+    }
+
+    // Splits the requested time range into at most two contiguous ring segments. newest is
+    // the newest bucket the column holds; later buckets in the window have no sales.
+    int windowSegments(time_t from, time_t to, size_t begin[2], size_t end[2], long long newest) const {
+        if (currentBucket < 0 || newest < 0 || to <= from) return 0;
+
+        long long oldest = currentBucket - static_cast<long long>(bucketCount) + 1;
+        long long firstBucket = max(oldest, static_cast<long long>(from) / bucketSeconds);
+        long long lastBucket = min(newest, (static_cast<long long>(to) - 1) / bucketSeconds);
+        if (firstBucket > lastBucket) return 0;
+
+        size_t firstSlot = slotOf(firstBucket);
+        size_t lastSlot = slotOf(lastBucket);
+        begin[0] = firstSlot;
+        if (firstSlot <= lastSlot) {
+            end[0] = lastSlot + 1;
+            return 1;
+        }
+        end[0] = bucketCount;
+        begin[1] = 0;
+        end[1] = lastSlot + 1;
+        return 2;
+    }
+
+    template <typename T>
+    static T sumColumn(const vector<T>& column, size_t offset, const size_t begin[2], const size_t end[2],
+                       int segments) {
+        T sum = 0;
+        for (int s = 0; s < segments; ++s) {
+            const T* values = column.data() + offset;
+            for (size_t slot = begin[s]; slot < end[s]; ++slot) {
+                sum += values[slot];
+            }
+        }
+        return sum;
+    }
+
+public:
+    // Product columns cost bucketCount * 12 bytes per product; leave them out when only the
+    // category report is needed, e.g. for multi-million-product catalogs
+    SalesAnalytics(int bucketSeconds = 3600, size_t bucketCount = 24 * 7, bool productColumns = true)
+        : bucketSeconds(bucketSeconds > 0 ? bucketSeconds : 3600),  // Added validation
+          bucketCount(bucketCount > 0 ? bucketCount : 1),
+          currentBucket(-1),
+          productColumns(productColumns),
+          categoryCount(0) {
+        ensureCategoryColumns(CATEGORY_BUILTIN_COUNT);
+    }
+
+    // Adds a product column; products are numbered in registration order like VendingMachine slots
+    void registerProduct(CategoryId category) {
+        lock_guard<mutex> lock(analyticsMutex);
+        ensureCategoryColumns(static_cast<size_t>(category) + 1);
+        productCategory.push_back(category);
+        if (productColumns) {
+            productBucket.push_back(-1);
+            productRevenue.resize(productCategory.size() * bucketCount, 0.0);
+            productUnits.resize(productCategory.size() * bucketCount, 0);
+        }
+    }
+
+    void recordSale(size_t product, int quantity, double amount, time_t timestamp) {
+        if (quantity <= 0 || amount < 0) return;  // Added validation
+
+        long long bucket = static_cast<long long>(timestamp) / bucketSeconds;
+        lock_guard<mutex> lock(analyticsMutex);
+        if (product >= productCategory.size()) return;
+        advanceTo(bucket);
+        if (bucket <= currentBucket - static_cast<long long>(bucketCount)) return;  // older than the window
+
+        size_t slot = slotOf(bucket);
+        size_t category = productCategory[product];
+        if (productColumns) {
+            advanceProduct(product, bucket);
+            productRevenue[product * bucketCount + slot] += amount;
+            productUnits[product * bucketCount + slot] += quantity;
+        }
+        categoryRevenue[category * bucketCount + slot] += amount;
+        categoryUnits[category * bucketCount + slot] += quantity;
+    }
+
+    size_t getProductCount() const {
+        lock_guard<mutex> lock(analyticsMutex);
+        return productCategory.size();
+    }
+
+    // Bus consumer: folds the sale lines of a batch
+    void onEvents(const SalesEvent* events, size_t count) override {
+        for (size_t i = 0; i < count; ++i) {
+            if (events[i].type == SALES_EVENT_SALE) {
+                recordSale(events[i].product, events[i].quantity, events[i].amount, events[i].timestamp);
+            }
+        }
+    }
+
+    double productRevenueBetween(size_t product, time_t from, time_t to) const {
+        lock_guard<mutex> lock(analyticsMutex);
+        size_t begin[2], end[2];
+        if (product >= productBucket.size()) return 0.0;
+        int segments = windowSegments(from, to, begin, end, productBucket[product]);
+        return sumColumn(productRevenue, product * bucketCount, begin, end, segments);
+    }
+
+    int productUnitsBetween(size_t product, time_t from, time_t to) const {
+        lock_guard<mutex> lock(analyticsMutex);
+        size_t begin[2], end[2];
+        if (product >= productBucket.size()) return 0;
+        int segments = windowSegments(from, to, begin, end, productBucket[product]);
+        return sumColumn(productUnits, product * bucketCount, begin, end, segments);
+    }
+
+    double categoryRevenueBetween(CategoryId category, time_t from, time_t to) const {
+        lock_guard<mutex> lock(analyticsMutex);
+        size_t begin[2], end[2];
+        int segments = windowSegments(from, to, begin, end, currentBucket);
+        if (category >= categoryCount) return 0.0;
+        return sumColumn(categoryRevenue, category * bucketCount, begin, end, segments);
+    }
+
+    // Rollup over the category columns, which are far fewer than the product columns
+    double totalRevenueBetween(time_t from, time_t to) const {
+        lock_guard<mutex> lock(analyticsMutex);
+        size_t begin[2], end[2];
+        int segments = windowSegments(from, to, begin, end, currentBucket);
+        double total = 0.0;
+        for (size_t i = 0; i < categoryCount; ++i) {
+            total += sumColumn(categoryRevenue, i * bucketCount, begin, end, segments);
+        }
+        return total;
+    }
+
+    vector<double> revenueByProduct(time_t from, time_t to) const {
+        lock_guard<mutex> lock(analyticsMutex);
+        size_t begin[2], end[2];
+        vector<double> result(productCategory.size(), 0.0);
+        for (size_t product = 0; product < productBucket.size(); ++product) {
+            int segments = windowSegments(from, to, begin, end, productBucket[product]);
+            result[product] = sumColumn(productRevenue, product * bucketCount, begin, end, segments);
+        }
+        return result;
+    }
+
+    // Indexed by CategoryId
+    vector<double> revenueByCategory(time_t from, time_t to) const {
+        lock_guard<mutex> lock(analyticsMutex);
+        size_t begin[2], end[2];
+        int segments = windowSegments(from, to, begin, end, currentBucket);
+        vector<double> result(categoryCount, 0.0);
+        for (size_t i = 0; i < categoryCount; ++i) {
+            result[i] = sumColumn(categoryRevenue, i * bucketCount, begin, end, segments);
+        }
+        return result;
+    }
+
+    // Fleet rollup: adds another machine's columns bucket by bucket. Product columns are
+    // matched by position, so both stores must describe the same planogram.
+    bool merge(const SalesAnalytics& other) {
+        if (&other == this) return false;
+        lock(analyticsMutex, other.analyticsMutex);
+        lock_guard<mutex> ownLock(analyticsMutex, adopt_lock);
+        lock_guard<mutex> otherLock(other.analyticsMutex, adopt_lock);
+
+        if (other.bucketSeconds != bucketSeconds || other.bucketCount != bucketCount ||
+            other.productCategory.size() != productCategory.size() || other.productColumns != productColumns) {
+            return false;
+        }
+        if (other.currentBucket < 0) return true;
+        ensureCategoryColumns(other.categoryCount);
+        advanceTo(other.currentBucket);
+
+        long long oldest = currentBucket - static_cast<long long>(bucketCount) + 1;  // advanced past other's
+        for (size_t product = 0; product < productBucket.size(); ++product) {
+            long long newest = other.productBucket[product];
+            if (newest < oldest) continue;  // nothing in the window
+            advanceProduct(product, newest);
+            for (long long bucket = max(oldest, newest - static_cast<long long>(bucketCount) + 1); bucket <= newest; ++bucket) {
+                size_t slot = slotOf(bucket);
+                productRevenue[product * bucketCount + slot] += other.productRevenue[product * bucketCount + slot];
+                productUnits[product * bucketCount + slot] += other.productUnits[product * bucketCount + slot];
+            }
+        }
+        for (long long bucket = oldest; bucket <= other.currentBucket; ++bucket) {
+            size_t slot = slotOf(bucket);
+            for (size_t category = 0; category < other.categoryCount; ++category) {
+                categoryRevenue[category * bucketCount + slot] += other.categoryRevenue[category * bucketCount + slot];
+                categoryUnits[category * bucketCount + slot] += other.categoryUnits[category * bucketCount + slot];
+            }
+        }
+        return true;
+    }
+
+    void displayCategoryReport(time_t from, time_t to) const {
+        vector<double> revenue = revenueByCategory(from, to);
+        vector<CategoryId> order;
+        for (size_t i = 0; i < revenue.size(); ++i) {
+            if (revenue[i] > 0) order.push_back(static_cast<CategoryId>(i));
+        }
+        sort(order.begin(), order.end(),
+             [&revenue](CategoryId a, CategoryId b) { return revenue[a] > revenue[b]; });
+        for (CategoryId category : order) {
+            cout << "  " << CategoryRegistry::getName(category) << ": $"
+                 << fixed << setprecision(2) << revenue[category] << endl;
+        }
+    }
+};
+
+// Space-Saving summary class - approximate heavy hitters in at most `capacity` counters.
+// A product that is not tracked takes over the smallest counter and inherits its count as
+// its possible overestimate (error), so any product sold more than total/capacity units is
+// guaranteed to be tracked. Counters sit in a min-heap; a fixed open-addressing table maps
+// products to heap positions, so offer() is O(log capacity) and never allocates.
+class SpaceSavingSummary {
+public:
+    struct Entry {
+        size_t product;
+        long long count;  // upper bound on the product's true units
+        long long error;  // count - error is a lower bound
+    };
+
+private:
+    struct Counter {
+        Entry entry;
+        size_t tableSlot;
+    };
+
+    size_t capacity;
+    vector<Counter> heap;   // min-heap on entry.count
+    vector<size_t> table;   // heap position + 1, 0 = empty; size is a power of two >= 2 * capacity
+    size_t tableMask;
+    long long total;
+
+    size_t hashSlot(size_t product) const {
+        return static_cast<size_t>((product + 1) * 0x9e3779b97f4a7c15ULL >> 17) & tableMask;
+    }
+
+    // Table slot holding product, or the empty slot where it would go
+    size_t findSlot(size_t product) const {
+        size_t slot = hashSlot(product);
+        while (table[slot] != 0 && heap[table[slot] - 1].entry.product != product) {
+            slot = (slot + 1) & tableMask;
+        }
+        return slot;
+    }
+
+    // Linear-probing delete: shifts later entries of the probe run back into the hole
+    void eraseSlot(size_t hole) {
+        table[hole] = 0;
+        for (size_t slot = (hole + 1) & tableMask; table[slot] != 0; slot = (slot + 1) & tableMask) {
+            size_t home = hashSlot(heap[table[slot] - 1].entry.product);
+            if (((slot - home) & tableMask) >= ((slot - hole) & tableMask)) {
+                table[hole] = table[slot];
+                heap[table[hole] - 1].tableSlot = hole;
+                table[slot] = 0;
+                hole = slot;
+            }
+        }
+    }
+
+    void place(size_t position, const Counter& counter) {
+        heap[position] = counter;
+        table[counter.tableSlot] = position + 1;
+    }
+
+    void siftUp(size_t position) {
+        Counter counter = heap[position];
+        while (position > 0) {
+            size_t parent = (position - 1) / 2;
+            if (heap[parent].entry.count <= counter.entry.count) break;
+            place(position, heap[parent]);
+            position = parent;
+        }
+        place(position, counter);
+    }
+
+    void siftDown(size_t position) {
+        Counter counter = heap[position];
+        while (true) {
+            size_t child = 2 * position + 1;
+            if (child >= heap.size()) break;
+            if (child + 1 < heap.size() && heap[child + 1].entry.count < heap[child].entry.count) child++;
+            if (counter.entry.count <= heap[child].entry.count) break;
+            place(position, heap[child]);
+            position = child;
+        }
+        place(position, counter);
+    }
+
+public:
+    SpaceSavingSummary(size_t capacity = 256) : capacity(max<size_t>(capacity, 1)), total(0) {
+        size_t tableSize = 1;
+        while (tableSize < 2 * this->capacity) tableSize <<= 1;
+        table.assign(tableSize, 0);
+        tableMask = tableSize - 1;
+        heap.reserve(this->capacity);
+    }
+
+    size_t getCapacity() const { return capacity; }
+    long long getTotal() const { return total; }
+
+    void clear() {
+        heap.clear();
+        fill(table.begin(), table.end(), 0);
+        total = 0;
+    }
+
+    void offer(size_t product, long long weight) {
+        if (weight <= 0) return;  // Added validation
+        total += weight;
+        size_t slot = findSlot(product);
+        if (table[slot] != 0) {
+            size_t position = table[slot] - 1;
+            heap[position].entry.count += weight;
+            siftDown(position);
+        } else if (heap.size() < capacity) {
+            heap.push_back(Counter{Entry{product, weight, 0}, slot});
+            siftUp(heap.size() - 1);
+        } else {
+            // Evict the smallest counter; the newcomer inherits its count as error
+            Entry evicted = heap[0].entry;
+            eraseSlot(heap[0].tableSlot);
+            slot = findSlot(product);
+            place(0, Counter{Entry{product, evicted.count + weight, evicted.count}, slot});
+            siftDown(0);
+        }
+    }
+
+    // Combines other into this summary (mergeable Space-Saving): counts of shared products
+    // add up, a product missing from a full summary is credited with that summary's minimum,
+    // and the largest `capacity` results are kept
+    void merge(const SpaceSavingSummary& other) {
+        long long ownFloor = heap.size() == capacity ? heap[0].entry.count : 0;
+        long long otherFloor = other.heap.size() == other.capacity ? other.heap[0].entry.count : 0;
+
+        vector<Entry> combined;
+        combined.reserve(heap.size() + other.heap.size());
+        for (const Counter& counter : heap) {
+            Entry entry = counter.entry;
+            size_t otherSlot = other.findSlot(entry.product);
+            if (other.table[otherSlot] != 0) {
+                const Entry& match = other.heap[other.table[otherSlot] - 1].entry;
+                entry.count += match.count;
+                entry.error += match.error;
+            } else {
+                entry.count += otherFloor;
+                entry.error += otherFloor;
+            }
+            combined.push_back(entry);
+        }
+        for (const Counter& counter : other.heap) {
+            if (table[findSlot(counter.entry.product)] == 0) {
+                combined.push_back(Entry{counter.entry.product, counter.entry.count + ownFloor,
+                                         counter.entry.error + ownFloor});
+            }
+        }
+
+        size_t keep = min(capacity, combined.size());
+        partial_sort(combined.begin(), combined.begin() + keep, combined.end(),
+                     [](const Entry& a, const Entry& b) { return a.count > b.count; });
+        long long mergedTotal = total + other.total;
+        clear();
+        for (size_t i = keep; i-- > 0;) {  // ascending counts keep the heap ordered without sifting
+            size_t slot = findSlot(combined[i].product);
+            heap.push_back(Counter{combined[i], slot});
+            table[slot] = heap.size();
+        }
+        total = mergedTotal;
+    }
+
+    // The k largest counters, best seller first
+    vector<Entry> top(size_t k) const {
+        vector<Entry> entries;
+        entries.reserve(heap.size());
+        for (const Counter& counter : heap) {
+            entries.push_back(counter.entry);
+        }
+        k = min(k, entries.size());
+        partial_sort(entries.begin(), entries.begin() + k, entries.end(),
+                     [](const Entry& a, const Entry& b) { return a.count > b.count; });
+        entries.resize(k);
+        return entries;
+    }
+};
+
+// Top seller tracker class - best sellers over sliding windows. Units sold go into a ring of
+// Space-Saving panes, one per paneSeconds; a window query merges the panes it covers, so
+// memory is paneCount * capacity counters however many products a fleet sells. Windows are
+// rounded to whole panes.
+class TopSellerTracker : public SalesEventConsumer {
+private:
+    int paneSeconds;
+    vector<SpaceSavingSummary> panes;
+    long long currentPane;  // absolute pane number held by the newest slot, -1 before first sale
+    mutable mutex topMutex;
+
+    SpaceSavingSummary& paneFor(long long pane) {
+        return panes[static_cast<size_t>(pane % static_cast<long long>(panes.size()))];
+    }
+
+public:
+    TopSellerTracker(size_t capacity = 256, int paneSeconds = 60, size_t paneCount = 60)
+        : paneSeconds(paneSeconds > 0 ? paneSeconds : 60),  // Added validation
+          currentPane(-1) {
+        paneCount = max<size_t>(paneCount, 1);
+        panes.reserve(paneCount);
+        for (size_t i = 0; i < paneCount; ++i) {
+            panes.emplace_back(capacity);  // built in place: a copied summary would lose its reserved heap
+        }
+    }
+
+    int getWindowLimit() const { return paneSeconds * static_cast<int>(panes.size()); }
+
+    void recordSale(size_t product, int quantity, time_t timestamp) {
+        long long pane = static_cast<long long>(timestamp) / paneSeconds;
+        lock_guard<mutex> lock(topMutex);
+        if (pane > currentPane) {
+            long long first = max(currentPane + 1, pane - static_cast<long long>(panes.size()) + 1);
+            for (long long p = first; p <= pane; ++p) {
+                paneFor(p).clear();
+            }
+            currentPane = pane;
+        }
+        if (pane <= currentPane - static_cast<long long>(panes.size())) return;  // older than the ring
+        paneFor(pane).offer(product, quantity);
+    }
+
+    // Bus consumer: folds the sale lines of a batch
+    void onEvents(const SalesEvent* events, size_t count) override {
+        for (size_t i = 0; i < count; ++i) {
+            if (events[i].type == SALES_EVENT_SALE) {
+                recordSale(events[i].product, events[i].quantity, events[i].timestamp);
+            }
+        }
+    }
+
+    // Merges the panes covering the last windowSeconds before now into window. Call it for
+    // each machine with the same window to get fleet-wide best sellers (the machines must
+    // share product numbering).
+    void collectWindow(int windowSeconds, time_t now, SpaceSavingSummary& window) const {
+        lock_guard<mutex> lock(topMutex);
+        if (currentPane < 0) return;
+        long long nowPane = static_cast<long long>(now) / paneSeconds;
+        long long firstPane = max(currentPane - static_cast<long long>(panes.size()) + 1,
+                                  nowPane - max(windowSeconds / paneSeconds, 1) + 1);
+        long long lastPane = min(currentPane, nowPane);
+        for (long long p = firstPane; p <= lastPane; ++p) {
+            window.merge(panes[static_cast<size_t>(p % static_cast<long long>(panes.size()))]);
+        }
+    }
+
+    vector<SpaceSavingSummary::Entry> topSellers(size_t k, int windowSeconds, time_t now) const {
+        SpaceSavingSummary window(panes[0].getCapacity());
+        collectWindow(windowSeconds, now, window);
+        return window.top(k);
+    }
+};
+
+struct DynamicPricingConfig {
+    double halfLifeSeconds;      // how quickly old sales stop counting towards velocity
+    double targetUnitsPerHour;   // velocity at which a product sells at list price
+    double velocityWeight;       // multiplier change per 100% deviation from the target velocity
+    double scarcityWeight;       // extra premium as stock approaches zero
+    int lowStockLevel;           // the scarcity premium starts below this stock level
+    double minMultiplier;
+    double maxMultiplier;
+};
+
+// Dynamic pricing engine class - adjusts per-product base prices from recent sales velocity
+// and remaining stock. Each sale or stock change updates one product's state in O(1);
+// velocity is an exponentially decayed rate, so no sales history is kept or rescanned.
+class DynamicPricingEngine : public SalesEventConsumer {
+private:
+    struct ProductState {
+        atomic<double> velocity;   // units per second, decayed to lastEvent
+        atomic<long long> lastEvent;
+        atomic<int> stock;
+
+        ProductState() : velocity(0.0), lastEvent(0), stock(0) {}
+    };
+
+    DynamicPricingConfig config;
+    double decayPerSecond;
+    deque<ProductState> states;  // deque: registering a product never moves existing states
+
+    double decayedVelocity(const ProductState& state, time_t now) const {
+        double elapsed = static_cast<double>(now - state.lastEvent.load(memory_order_relaxed));
+        double velocity = state.velocity.load(memory_order_relaxed);
+        return elapsed > 0 ? velocity * exp(-decayPerSecond * elapsed) : velocity;
+    }
+
+public:
+    explicit DynamicPricingEngine(const DynamicPricingConfig& config)
+        : config(config),
+          decayPerSecond(log(2.0) / (config.halfLifeSeconds > 0 ? config.halfLifeSeconds : 3600.0)) {}
+
+    static DynamicPricingConfig defaultConfig() {
+        DynamicPricingConfig config;
+        config.halfLifeSeconds = 3600;
+        config.targetUnitsPerHour = 10;
+        config.velocityWeight = 0.10;
+        config.scarcityWeight = 0.15;
+        config.lowStockLevel = 5;
+        config.minMultiplier = 0.80;
+        config.maxMultiplier = 1.30;
+        return config;
+    }
+
+    // Register products in slot order before purchases start
+    void registerProduct(int stock, time_t now) {
+        states.emplace_back();
+        states.back().stock.store(stock);
+        states.back().lastEvent.store(now);
+    }
+
+    size_t getProductCount() const { return states.size(); }
+
+    // O(1): folds this sale into the decayed velocity. Callers serialize updates per product.
+    void recordSale(size_t product, int quantity, int remainingStock, time_t now) {
+        if (product >= states.size() || quantity <= 0) return;  // Added validation
+
+        ProductState& state = states[product];
+        double velocity = decayedVelocity(state, now) + quantity * decayPerSecond;
+        state.velocity.store(velocity, memory_order_relaxed);
+        state.lastEvent.store(now, memory_order_relaxed);
+        state.stock.store(remainingStock, memory_order_relaxed);
+    }
+
+    void recordStockChange(size_t product, int stock) {
+        if (product >= states.size()) return;  // Added validation
+        states[product].stock.store(stock, memory_order_relaxed);
+    }
+
+    // Bus consumer: the single bus thread serializes updates, as recordSale requires
+    void onEvents(const SalesEvent* events, size_t count) override {
+        for (size_t i = 0; i < count; ++i) {
+            const SalesEvent& event = events[i];
+            if (event.type == SALES_EVENT_SALE) {
+                recordSale(event.product, event.quantity, event.stockAfter, event.timestamp);
+            } else if (event.type == SALES_EVENT_RESTOCK || event.type == SALES_EVENT_RELEASE) {
+                recordStockChange(event.product, event.stockAfter);
+            }
+        }
+    }
+
+    // Lock-free; applied to the base price before the product type's own pricing rule
+    double multiplier(size_t product, time_t now) const {
+        if (product >= states.size()) return 1.0;
+
+        const ProductState& state = states[product];
+        double unitsPerHour = decayedVelocity(state, now) * 3600.0;
+        double target = config.targetUnitsPerHour > 0 ? config.targetUnitsPerHour : 1.0;
+        double result = 1.0 + config.velocityWeight * (unitsPerHour / target - 1.0);
+
+        int stock = state.stock.load(memory_order_relaxed);
+        if (config.lowStockLevel > 0 && stock < config.lowStockLevel) {
+            result += config.scarcityWeight * (1.0 - static_cast<double>(stock) / config.lowStockLevel);
+        }
+        return min(config.maxMultiplier, max(config.minMultiplier, result));
+    }
+};
+
+enum PromotionType {
+    PROMOTION_PERCENT_OFF,  // percent off matching lines
+    PROMOTION_MULTI_BUY,    // buy buyQuantity, get freeQuantity free
+    PROMOTION_BUNDLE,       // percent off matching lines when the basket also has a partner item
+    PROMOTION_HAPPY_HOUR    // percent off matching lines between startHour and endHour (local time)
+};
+
+// A promotion as written by an operator. Targets and partners are a product slot or a category.
+struct PromotionRule {
+    string name;
+    PromotionType type;
+    bool targetsCategory;
+    size_t product;
+    CategoryId category;
+    double percent;
+    int buyQuantity;
+    int freeQuantity;
+    bool partnerIsCategory;
+    size_t partnerProduct;
+    CategoryId partnerCategory;
+    int startHour;
+    int endHour;
+
+    PromotionRule()
+        : type(PROMOTION_PERCENT_OFF), targetsCategory(false), product(0), category(CATEGORY_GENERAL),
+          percent(0), buyQuantity(0), freeQuantity(0), partnerIsCategory(false), partnerProduct(0),
+          partnerCategory(CATEGORY_GENERAL), startHour(0), endHour(24) {}
+};
+
+// One basket line as seen by the promotion engine
+struct BasketLine {
+    size_t product;
+    int quantity;
+    double unitPrice;
+};
+
+// Promotion engine class - compiles declarative rules into a flat decision table.
+// Rules are grouped per product slot and per category into one decision row each, with
+// dominated rules folded away at compile time: percent-off keeps the best rate, happy hours
+// become a 24-entry rate table, multi-buys are deduplicated and bundles become a sorted
+// partner list. Pricing a line therefore costs two row lookups, however many promotions
+// are active. Promotions do not stack: each line gets the single best discount.
+class PromotionEngine {
+private:
+    struct RuleChoice {
+        double rate;
+        int rule;  // -1 = none
+    };
+
+    struct MultiBuyOffer {
+        int buyQuantity;
+        int freeQuantity;
+        int rule;
+    };
+
+    struct BundleOffer {
+        unsigned long long partnerKey;  // see partnerKey()
+        double rate;
+        int rule;
+    };
+
+    struct DecisionRow {
+        RuleChoice percent;
+        int hourBase;  // first of 24 entries in hourChoices, -1 = no happy hour
+        unsigned multiBuyBegin, multiBuyEnd;
+        unsigned bundleBegin, bundleEnd;
+    };
+
+    vector<string> names;
+    vector<CategoryId> productCategory;  // planogram snapshot taken at compile time
+    vector<int> productRow;              // slot -> row, -1 = no product-specific promotions
+    vector<int> categoryRow;             // category -> row
+    vector<DecisionRow> rows;
+    vector<RuleChoice> hourChoices;
+    vector<MultiBuyOffer> multiBuys;
+    vector<BundleOffer> bundles;
+
+    static unsigned long long partnerKey(bool isCategory, size_t id) {
+        return (static_cast<unsigned long long>(isCategory) << 63) | id;
+    }
+
+    static void keepBest(RuleChoice& choice, double rate, int rule) {
+        if (choice.rule < 0 || rate > choice.rate) {
+            choice.rate = rate;
+            choice.rule = rule;
+        }
+    }
+
+    // Folds all rules of one product or category into a decision row
+    int buildRow(const vector<PromotionRule>& rules, const vector<int>& ruleIds,
+                 const vector<unsigned>& members) {
+        DecisionRow row;
+        row.percent.rate = 0.0;
+        row.percent.rule = -1;
+        row.hourBase = -1;
+        row.multiBuyBegin = row.multiBuyEnd = static_cast<unsigned>(multiBuys.size());
+        row.bundleBegin = static_cast<unsigned>(bundles.size());
+
+        for (unsigned member : members) {
+            const PromotionRule& rule = rules[member];
+            int id = ruleIds[member];
+            double rate = rule.percent / 100.0;
+            switch (rule.type) {
+                case PROMOTION_PERCENT_OFF:
+                    keepBest(row.percent, rate, id);
+                    break;
+                case PROMOTION_HAPPY_HOUR:
+                    if (row.hourBase < 0) {
+                        row.hourBase = static_cast<int>(hourChoices.size());
+                        hourChoices.resize(hourChoices.size() + 24, RuleChoice{0.0, -1});
+                    }
+                    for (int hour = 0; hour < 24; ++hour) {
+                        bool active = rule.startHour <= rule.endHour
+                                          ? hour >= rule.startHour && hour < rule.endHour
+                                          : hour >= rule.startHour || hour < rule.endHour;  // wraps midnight
+                        if (active) keepBest(hourChoices[row.hourBase + hour], rate, id);
+                    }
+                    break;
+                case PROMOTION_MULTI_BUY: {
+                    bool duplicate = false;
+                    for (unsigned m = row.multiBuyBegin; m < multiBuys.size(); ++m) {
+                        duplicate = duplicate || (multiBuys[m].buyQuantity == rule.buyQuantity &&
+                                                  multiBuys[m].freeQuantity == rule.freeQuantity);
+                    }
+                    if (!duplicate) multiBuys.push_back(MultiBuyOffer{rule.buyQuantity, rule.freeQuantity, id});
+                    break;
+                }
+                case PROMOTION_BUNDLE:
+                    bundles.push_back(BundleOffer{
+                        partnerKey(rule.partnerIsCategory,
+                                   rule.partnerIsCategory ? static_cast<size_t>(rule.partnerCategory) : rule.partnerProduct),
+                        rate, id});
+                    break;
+            }
+        }
+        row.multiBuyEnd = static_cast<unsigned>(multiBuys.size());
+
+        // One offer per partner (the best), sorted for binary search
+        sort(bundles.begin() + row.bundleBegin, bundles.end(), [](const BundleOffer& a, const BundleOffer& b) {
+            return a.partnerKey < b.partnerKey || (a.partnerKey == b.partnerKey && a.rate > b.rate);
+        });
+        bundles.erase(unique(bundles.begin() + row.bundleBegin, bundles.end(),
+                             [](const BundleOffer& a, const BundleOffer& b) { return a.partnerKey == b.partnerKey; }),
+                      bundles.end());
+        row.bundleEnd = static_cast<unsigned>(bundles.size());
+
+        rows.push_back(row);
+        return static_cast<int>(rows.size() - 1);
+    }
+
+    const BundleOffer* findBundle(const DecisionRow& row, unsigned long long key) const {
+        const BundleOffer* first = bundles.data() + row.bundleBegin;
+        const BundleOffer* last = bundles.data() + row.bundleEnd;
+        const BundleOffer* found = lower_bound(first, last, key,
+                                               [](const BundleOffer& offer, unsigned long long k) {
+                                                   return offer.partnerKey < k;
+                                               });
+        return found != last && found->partnerKey == key ? found : nullptr;
+    }
+
+    void evaluateRow(const DecisionRow& row, const BasketLine* lines, size_t count, size_t index,
+                     time_t now, int& localHour, double& best, int& bestRule) const {
+        const BasketLine& line = lines[index];
+        double lineTotal = line.unitPrice * line.quantity;
+
+        if (row.percent.rule >= 0 && lineTotal * row.percent.rate > best) {
+            best = lineTotal * row.percent.rate;
+            bestRule = row.percent.rule;
+        }
+        if (row.hourBase >= 0) {
+            if (localHour < 0) localHour = localHourOf(now);
+            const RuleChoice& choice = hourChoices[row.hourBase + localHour];
+            if (choice.rule >= 0 && lineTotal * choice.rate > best) {
+                best = lineTotal * choice.rate;
+                bestRule = choice.rule;
+            }
+        }
+        for (unsigned m = row.multiBuyBegin; m < row.multiBuyEnd; ++m) {
+            const MultiBuyOffer& offer = multiBuys[m];
+            double discount = line.unitPrice * (line.quantity / (offer.buyQuantity + offer.freeQuantity)) *
+                              offer.freeQuantity;
+            if (discount > best) {
+                best = discount;
+                bestRule = offer.rule;
+            }
+        }
+        if (row.bundleBegin == row.bundleEnd) return;
+        for (size_t other = 0; other < count; ++other) {
+            if (other == index || lines[other].product >= productCategory.size()) continue;
+            const BundleOffer* offers[2] = {
+                findBundle(row, partnerKey(false, lines[other].product)),
+                findBundle(row, partnerKey(true, productCategory[lines[other].product]))
+            };
+            for (const BundleOffer* offer : offers) {
+                if (offer != nullptr && lineTotal * offer->rate > best) {
+                    best = lineTotal * offer->rate;
+                    bestRule = offer->rule;
+                }
+            }
+        }
+    }
+
+    // Splits on spaces; double quotes group words and are removed
+    static vector<string> splitRuleTokens(const string& line) {
+        vector<string> tokens;
+        string current;
+        bool quoted = false;
+        for (char c : line) {
+            if (c == '"') {
+                quoted = !quoted;
+            } else if ((c == ' ' || c == '\t' || c == '\r') && !quoted) {
+                if (!current.empty()) tokens.push_back(current);
+                current.clear();
+            } else {
+                current.push_back(c);
+            }
+        }
+        if (!current.empty()) tokens.push_back(current);
+        return tokens;
+    }
+
+    static int localHourOf(time_t now) {
+        tm local;
+#ifdef _WIN32
+        localtime_s(&local, &now);
+#else
+        localtime_r(&now, &local);
+#endif
+        return local.tm_hour;
+    }
+
+public:
+    // Builds the decision table; productCategories is the machine's planogram, one entry per slot
+    void compile(const vector<PromotionRule>& rules, const vector<CategoryId>& productCategories) {
+        names.clear();
+        rows.clear();
+        hourChoices.clear();
+        multiBuys.clear();
+        bundles.clear();
+        productCategory = productCategories;
+        productRow.assign(productCategories.size(), -1);
+        categoryRow.assign(CategoryRegistry::count(), -1);
+
+        // Number the valid rules and group them by target
+        vector<int> ruleIds(rules.size(), -1);
+        vector<pair<size_t, unsigned>> byProduct, byCategory;
+        for (size_t i = 0; i < rules.size(); ++i) {
+            const PromotionRule& rule = rules[i];
+            bool valid = rule.percent >= 0 && rule.percent <= 100 &&
+                         (rule.type != PROMOTION_MULTI_BUY || (rule.buyQuantity > 0 && rule.freeQuantity > 0)) &&
+                         (rule.targetsCategory ? rule.category < categoryRow.size()
+                                               : rule.product < productCategories.size());
+            if (!valid) continue;  // Added validation
+
+            ruleIds[i] = static_cast<int>(names.size());
+            names.push_back(rule.name.empty() ? "Promotion " + to_string(names.size() + 1) : rule.name);
+            if (rule.targetsCategory) {
+                byCategory.push_back(make_pair(static_cast<size_t>(rule.category), static_cast<unsigned>(i)));
+            } else {
+                byProduct.push_back(make_pair(rule.product, static_cast<unsigned>(i)));
+            }
+        }
+
+        sort(byProduct.begin(), byProduct.end());
+        sort(byCategory.begin(), byCategory.end());
+        vector<unsigned> members;
+        for (int pass = 0; pass < 2; ++pass) {
+            const vector<pair<size_t, unsigned>>& grouped = pass == 0 ? byProduct : byCategory;
+            vector<int>& target = pass == 0 ? productRow : categoryRow;
+            for (size_t i = 0; i < grouped.size();) {
+                members.clear();
+                size_t key = grouped[i].first;
+                for (; i < grouped.size() && grouped[i].first == key; ++i) {
+                    members.push_back(grouped[i].second);
+                }
+                target[key] = buildRow(rules, ruleIds, members);
+            }
+        }
+    }
+
+    size_t size() const { return names.size(); }
+
+    const string& ruleName(int rule) const { return names[rule]; }
+
+    // Total discount for a basket. appliedRules (optional, one entry per line) receives
+    // the winning rule index or -1.
+    double apply(const BasketLine* lines, size_t count, time_t now, int* appliedRules = nullptr) const {
+        double totalDiscount = 0.0;
+        int localHour = -1;
+        for (size_t i = 0; i < count; ++i) {
+            double best = 0.0;
+            int bestRule = -1;
+            size_t product = lines[i].product;
+            if (product < productCategory.size()) {
+                if (productRow[product] >= 0) {
+                    evaluateRow(rows[productRow[product]], lines, count, i, now, localHour, best, bestRule);
+                }
+                CategoryId category = productCategory[product];
+                if (category < categoryRow.size() && categoryRow[category] >= 0) {
+                    evaluateRow(rows[categoryRow[category]], lines, count, i, now, localHour, best, bestRule);
+                }
+            }
+            totalDiscount += best;
+            if (appliedRules != nullptr) {
+                appliedRules[i] = bestRule;
+            }
+        }
+        return totalDiscount;
+    }
+
+    // Parses one rule per line:  <percent|multibuy|bundle|happyhour> key=value ...
+    // keys: name, product (number as displayed), category, percent, buy, free,
+    //       partner-product, partner-category, from, to (hours). Quote values with spaces.
+    static size_t parseRules(istream& in, vector<PromotionRule>& rules) {
+        size_t parsed = 0;
+        string line;
+        while (getline(in, line)) {
+            vector<string> tokens = splitRuleTokens(line);
+            if (tokens.empty() || tokens[0][0] == '#') continue;
+            const string& type = tokens[0];
+
+            PromotionRule rule;
+            if (type == "percent") rule.type = PROMOTION_PERCENT_OFF;
+            else if (type == "multibuy") rule.type = PROMOTION_MULTI_BUY;
+            else if (type == "bundle") rule.type = PROMOTION_BUNDLE;
+            else if (type == "happyhour") rule.type = PROMOTION_HAPPY_HOUR;
+            else {
+                cout << "Skipping unknown promotion type: " << type << endl;
+                continue;
+            }
+
+            bool hasTarget = false;
+            bool hasPartner = false;
+            for (size_t t = 1; t < tokens.size(); ++t) {
+                const string& token = tokens[t];
+                size_t equals = token.find('=');
+                if (equals == string::npos) continue;
+                string key = token.substr(0, equals);
+                string value = token.substr(equals + 1);
+
+                if (key == "name") rule.name = value;
+                else if (key == "product") {
+                    rule.product = static_cast<size_t>(max(1L, atol(value.c_str())) - 1);
+                    rule.targetsCategory = false;
+                    hasTarget = true;
+                } else if (key == "category") {
+                    rule.category = CategoryRegistry::registerCategory(value);
+                    rule.targetsCategory = true;
+                    hasTarget = true;
+                } else if (key == "percent") rule.percent = atof(value.c_str());
+                else if (key == "buy") rule.buyQuantity = atoi(value.c_str());
+                else if (key == "free") rule.freeQuantity = atoi(value.c_str());
+                else if (key == "partner-product") {
+                    rule.partnerProduct = static_cast<size_t>(max(1L, atol(value.c_str())) - 1);
+                    rule.partnerIsCategory = false;
+                    hasPartner = true;
+                } else if (key == "partner-category") {
+                    rule.partnerCategory = CategoryRegistry::registerCategory(value);
+                    rule.partnerIsCategory = true;
+                    hasPartner = true;
+                } else if (key == "from") rule.startHour = atoi(value.c_str());
+                else if (key == "to") rule.endHour = atoi(value.c_str());
+            }
+
+            if (!hasTarget || (rule.type == PROMOTION_BUNDLE && !hasPartner)) {
+                cout << "Skipping incomplete promotion: " << line << endl;
+                continue;
+            }
+            rules.push_back(rule);
+            parsed++;
+        }
+        return parsed;
+    }
+};
+
+// Idempotency table class - remembers the outcome of recent keyed requests so a retried
+// request gets the original answer instead of running again. Fixed capacity, open
+// addressing over a short probe window, no locks: each slot carries a state word
+// (generation << 2 | phase) that is claimed with a CAS, and readers validate what they read
+// against it like a seqlock. Entries expire after ttlSeconds and their slots are reused.
+// A retry that arrives after its key expired runs again as a new request. If every slot
+// near a key is still live, the oldest finished entry there is evicted early (and counted),
+// so overload shortens the retry window instead of failing purchases; size the table for
+// request rate x ttl to avoid that.
+class IdempotencyTable {
+public:
+    enum Claim {
+        CLAIM_NEW,        // first sighting: run the request, then call complete()
+        CLAIM_DUPLICATE,  // seen before: succeeded/amount hold the original outcome
+        CLAIM_FULL        // every slot near the key is still running a request; reject it
+    };
+
+    struct Ticket {
+        size_t slot;
+        unsigned long long generation;
+    };
+
+private:
+    enum Phase { PHASE_FREE = 0, PHASE_WRITING = 1, PHASE_PENDING = 2, PHASE_DONE = 3 };
+    static const size_t PROBE_LIMIT = 16;
+
+    struct Slot {
+        atomic<unsigned long long> state;
+        atomic<unsigned long long> key;
+        atomic<long long> claimedAt;
+        atomic<bool> succeeded;
+        atomic<double> amount;
+    };
+
+    unique_ptr<Slot[]> slots;
+    size_t mask;
+    long long ttlSeconds;
+    atomic<long> claims;
+    atomic<long> duplicates;
+    atomic<long> rejected;
+    atomic<long> evicted;
+
+    static unsigned long long mix(unsigned long long x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+public:
+    // capacity is rounded up to a power of two
+    IdempotencyTable(size_t capacity = 1 << 20, int ttlSeconds = 300)
+        : ttlSeconds(max(ttlSeconds, 1)), claims(0), duplicates(0), rejected(0), evicted(0) {
+        size_t size = PROBE_LIMIT;
+        while (size < capacity) size <<= 1;
+        slots.reset(new Slot[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            slots[i].state.store(PHASE_FREE, memory_order_relaxed);
+            slots[i].key.store(0, memory_order_relaxed);
+            slots[i].claimedAt.store(0, memory_order_relaxed);
+            slots[i].succeeded.store(false, memory_order_relaxed);
+            slots[i].amount.store(0.0, memory_order_relaxed);
+        }
+    }
+
+    // O(1): probes at most PROBE_LIMIT slots. A duplicate of a request that is still running
+    // waits for it to finish.
+    Claim begin(unsigned long long key, time_t now, Ticket& ticket, bool& succeeded, double& amount) {
+        while (true) {
+            size_t start = static_cast<size_t>(mix(key));
+            Slot* candidate = nullptr;
+            unsigned long long candidateState = 0;
+            Slot* oldest = nullptr;  // eviction fallback: the oldest finished entry in the window
+            unsigned long long oldestState = 0;
+            long long oldestClaimedAt = 0;
+            bool retry = false;
+            for (size_t i = 0; i < PROBE_LIMIT && !retry; ++i) {
+                Slot& slot = slots[(start + i) & mask];
+                unsigned long long state = slot.state.load(memory_order_acquire);
+                unsigned long long phase = state & 3;
+                if (phase == PHASE_WRITING) {
+                    retry = true;  // a claim is half written; it may be ours
+                    break;
+                }
+                if (phase == PHASE_FREE) {
+                    if (candidate == nullptr) {
+                        candidate = &slot;
+                        candidateState = state;
+                    }
+                    break;  // slots never return to free, so the key cannot be further on
+                }
+                unsigned long long slotKey = slot.key.load(memory_order_relaxed);
+                long long claimedAt = slot.claimedAt.load(memory_order_relaxed);
+                bool slotSucceeded = slot.succeeded.load(memory_order_relaxed);
+                double slotAmount = slot.amount.load(memory_order_relaxed);
+                atomic_thread_fence(memory_order_acquire);  // the fields above were read before the recheck
+                if (slot.state.load(memory_order_relaxed) != state) {
+                    retry = true;
+                    break;
+                }
+                bool live = phase == PHASE_PENDING || now - claimedAt < ttlSeconds;
+                if (slotKey == key && live) {
+                    if (phase == PHASE_PENDING) {
+                        retry = true;  // the original is still running
+                        break;
+                    }
+                    succeeded = slotSucceeded;
+                    amount = slotAmount;
+                    duplicates.fetch_add(1, memory_order_relaxed);
+                    return CLAIM_DUPLICATE;
+                }
+                if (!live && candidate == nullptr) {
+                    candidate = &slot;
+                    candidateState = state;
+                }
+                if (phase == PHASE_DONE && (oldest == nullptr || claimedAt < oldestClaimedAt)) {
+                    oldest = &slot;
+                    oldestState = state;
+                    oldestClaimedAt = claimedAt;
+                }
+            }
+            if (retry) {
+                this_thread::yield();
+                continue;
+            }
+            if (candidate == nullptr && oldest != nullptr) {
+                candidate = oldest;
+                candidateState = oldestState;
+                evicted.fetch_add(1, memory_order_relaxed);
+            }
+            if (candidate == nullptr) {
+                rejected.fetch_add(1, memory_order_relaxed);
+                return CLAIM_FULL;
+            }
+
+            unsigned long long generation = (candidateState >> 2) + 1;
+            if (!candidate->state.compare_exchange_strong(candidateState, generation << 2 | PHASE_WRITING,
+                                                          memory_order_acq_rel)) {
+                continue;  // another request took the slot first
+            }
+            candidate->key.store(key, memory_order_relaxed);
+            candidate->claimedAt.store(now, memory_order_relaxed);
+            candidate->state.store(generation << 2 | PHASE_PENDING, memory_order_release);
+            ticket = Ticket{static_cast<size_t>(candidate - slots.get()), generation};
+            claims.fetch_add(1, memory_order_relaxed);
+            return CLAIM_NEW;
+        }
+    }
+
+    // Records the outcome of a request claimed with begin()
+    void complete(const Ticket& ticket, bool succeeded, double amount) {
+        Slot& slot = slots[ticket.slot];
+        slot.succeeded.store(succeeded, memory_order_relaxed);
+        slot.amount.store(amount, memory_order_relaxed);
+        slot.state.store(ticket.generation << 2 | PHASE_DONE, memory_order_release);
+    }
+
+    void displayStats() const {
+        cout << "Idempotency: " << claims.load() << " requests, " << duplicates.load()
+             << " retries answered from the table, " << evicted.load() << " entries evicted before expiry, "
+             << rejected.load() << " rejected (table full)" << endl;
+    }
+};
+
+// Change maker class - coin and bill inventory plus change dispensing for any denomination
+// set with limited stock. A bounded-knapsack table per denomination layer gives, for every
+// change amount up to maxChange, the fewest coins using only the k largest denominations
+// and how many of the k-th that solution takes; a change lookup then walks the layers once,
+// so it costs O(denominations). The tables always match the hoppers. A layer only depends on
+// its hopper's usable count: the count capped at the coins that change up to maxChange could
+// ever take (one $20 bill covers any $20 change). When a usable count moves, the layers are
+// rebuilt from that denomination's layer up, each in O(maxChange / smallest unit); bills paid
+// in past their cap cost nothing.
+class ChangeMaker {
+private:
+    static const int NO_SOLUTION = 1 << 29;
+
+    vector<int> denominations;  // cents, ascending
+    vector<int> stock;
+    vector<int> tableStock;     // usable counts the tables were built from
+    int unit;                   // gcd of the denominations; tables count in these units
+    int maxAmount;              // in units
+    vector<vector<int>> fewestCoins;  // [layer][amount]; layer k uses the k largest denominations
+    vector<vector<int>> taken;        // [layer][amount]: coins of layer k's denomination in that solution
+    vector<int> window;               // monotone queue scratch
+    long cashSales;
+    long refusedSales;                // not enough paid, or no change available
+    mutable mutex cashMutex;
+
+    static int gcd(int a, int b) { return b == 0 ? a : gcd(b, a % b); }
+
+    // Layers add denominations largest first: bills are usually past their cap, and a sale
+    // then rebuilds only the layers of the coins it paid out
+    size_t denominationOf(size_t layer) const { return denominations.size() - layer; }
+
+    // Layer k from layer k-1: for each residue class mod d, a sliding-window minimum over the
+    // last stock+1 entries (monotone queue) picks how many coins of value d to use
+    void rebuildLayer(size_t k) {
+        size_t index = denominationOf(k);
+        int d = denominations[index] / unit;
+        int limit = tableStock[index];
+        const vector<int>& previous = fewestCoins[k - 1];
+        vector<int>& current = fewestCoins[k];
+        vector<int>& count = taken[k];
+        if (static_cast<long long>(limit) * d >= maxAmount) {
+            // Enough coins to cover any amount: plain unbounded recurrence, no window needed
+            for (int amount = 0; amount <= maxAmount; ++amount) {
+                current[amount] = previous[amount];
+                count[amount] = 0;
+                if (amount >= d && current[amount - d] + 1 < current[amount]) {
+                    current[amount] = current[amount - d] + 1;
+                    count[amount] = count[amount - d] + 1;
+                }
+            }
+            return;
+        }
+        for (int residue = 0; residue < d && residue <= maxAmount; ++residue) {
+            size_t head = 0, tail = 0;
+            for (int t = 0, amount = residue; amount <= maxAmount; ++t, amount += d) {
+                if (previous[amount] < NO_SOLUTION) {
+                    int value = previous[amount] - t;
+                    while (tail > head && previous[residue + window[tail - 1] * d] - window[tail - 1] >= value) tail--;
+                    window[tail++] = t;
+                }
+                while (tail > head && window[head] < t - limit) head++;
+                if (tail == head) {
+                    current[amount] = NO_SOLUTION;
+                    count[amount] = 0;
+                } else {
+                    int s = window[head];
+                    current[amount] = previous[residue + s * d] + (t - s);
+                    count[amount] = t - s;
+                }
+            }
+        }
+    }
+
+    void rebuildFrom(size_t layer) {
+        for (size_t k = layer; k <= denominations.size(); ++k) {
+            rebuildLayer(k);
+        }
+    }
+
+    // Fills counts with the change for amount cents from the tables; caller holds cashMutex
+    bool lookup(long long amountCents, vector<int>& counts) const {
+        counts.assign(denominations.size(), 0);
+        if (amountCents < 0 || amountCents % unit != 0 || amountCents / unit > maxAmount) return false;
+        int amount = static_cast<int>(amountCents / unit);
+        if (fewestCoins[denominations.size()][amount] >= NO_SOLUTION) return false;
+        for (size_t k = denominations.size(); k > 0; --k) {
+            size_t index = denominationOf(k);
+            counts[index] = taken[k][amount];
+            amount -= counts[index] * (denominations[index] / unit);
+        }
+        return true;
+    }
+
+    // Coins of denomination index that change up to maxAmount can use
+    int usable(size_t index) const {
+        int d = denominations[index] / unit;
+        return min(stock[index], (maxAmount + d - 1) / d);
+    }
+
+    // Applies signed hopper changes and rebuilds the layers from the first one whose usable
+    // count moved, so lookups stay exact. Caller holds cashMutex.
+    void adjust(const vector<int>& counts, int sign) {
+        size_t first = denominations.size() + 1;
+        for (size_t i = 0; i < counts.size() && i < denominations.size(); ++i) {
+            stock[i] += sign * counts[i];
+            int count = usable(i);
+            if (count != tableStock[i]) {
+                tableStock[i] = count;
+                first = min(first, denominations.size() - i);  // the layer of denomination i
+            }
+        }
+        if (first <= denominations.size()) {
+            rebuildFrom(first);
+        }
+    }
+
+public:
+    // Denominations in cents (any order, duplicates ignored); change above maxChangeCents is refused
+    ChangeMaker(vector<int> denominationCents, int maxChangeCents = 2000) {
+        denominationCents.erase(remove_if(denominationCents.begin(), denominationCents.end(),
+                                          [](int d) { return d <= 0; }),
+                                denominationCents.end());  // Added validation
+        sort(denominationCents.begin(), denominationCents.end());
+        denominationCents.erase(unique(denominationCents.begin(), denominationCents.end()), denominationCents.end());
+        if (denominationCents.empty()) denominationCents.push_back(1);
+        denominations = denominationCents;
+        cashSales = 0;
+        refusedSales = 0;
+        stock.assign(denominations.size(), 0);
+        tableStock = stock;
+
+        unit = 0;
+        for (int d : denominations) unit = gcd(d, unit);
+        maxAmount = max(maxChangeCents, 0) / unit;
+        fewestCoins.assign(denominations.size() + 1, vector<int>(maxAmount + 1, NO_SOLUTION));
+        taken.assign(denominations.size() + 1, vector<int>(maxAmount + 1, 0));
+        fewestCoins[0][0] = 0;
+        window.resize(maxAmount + 2);
+        rebuildFrom(1);
+    }
+
+    size_t getDenominationCount() const { return denominations.size(); }
+    int getDenomination(size_t index) const { return denominations[index]; }
+
+    int getStock(size_t index) const {
+        lock_guard<mutex> lock(cashMutex);
+        return stock[index];
+    }
+
+    void addCoins(size_t index, int count) {
+        if (index >= denominations.size() || count <= 0) return;  // Added validation
+        vector<int> counts(denominations.size(), 0);
+        counts[index] = count;
+        lock_guard<mutex> lock(cashMutex);
+        adjust(counts, 1);
+    }
+
+    // Raises every hopper to at least levels[i], e.g. on a service visit
+    void topUp(const vector<int>& levels) {
+        vector<int> counts(denominations.size(), 0);
+        lock_guard<mutex> lock(cashMutex);
+        for (size_t i = 0; i < counts.size() && i < levels.size(); ++i) {
+            counts[i] = max(0, levels[i] - stock[i]);
+        }
+        adjust(counts, 1);
+    }
+
+    // Fewest-coin change for amountCents from the current stock, without dispensing it
+    bool makeChange(long long amountCents, vector<int>& counts) const {
+        lock_guard<mutex> lock(cashMutex);
+        return lookup(amountCents, counts);
+    }
+
+    // One cash sale: the inserted coins go into the hoppers and the change comes out. If the
+    // change cannot be made the inserted coins are handed back and nothing changes.
+    bool acceptPayment(const vector<int>& inserted, long long priceCents, vector<int>& change) {
+        long long paid = 0;
+        for (size_t i = 0; i < inserted.size() && i < denominations.size(); ++i) {
+            paid += static_cast<long long>(inserted[i]) * denominations[i];
+        }
+        lock_guard<mutex> lock(cashMutex);
+        if (paid < priceCents) {
+            change.assign(denominations.size(), 0);
+            refusedSales++;
+            return false;
+        }
+        // Usually the hoppers can already cover the change, and the sale moves the hoppers
+        // once. Otherwise the inserted coins may help, so they go in before a second lookup.
+        vector<int> net(inserted);
+        net.resize(denominations.size(), 0);
+        if (lookup(paid - priceCents, change)) {
+            for (size_t i = 0; i < net.size(); ++i) net[i] -= change[i];
+            adjust(net, 1);
+            cashSales++;
+            return true;
+        }
+        adjust(net, 1);
+        if (!lookup(paid - priceCents, change)) {
+            adjust(net, -1);
+            change.assign(denominations.size(), 0);
+            refusedSales++;
+            return false;
+        }
+        adjust(change, -1);
+        cashSales++;
+        return true;
+    }
+
+    // Coins a customer would insert for amountCents: the smallest single coin or bill that
+    // covers it, or enough of the largest
+    vector<int> tenderFor(long long amountCents) const {
+        vector<int> inserted(denominations.size(), 0);
+        for (size_t i = 0; i < denominations.size(); ++i) {
+            if (denominations[i] >= amountCents) {
+                inserted[i] = 1;
+                return inserted;
+            }
+        }
+        inserted.back() = static_cast<int>((amountCents + denominations.back() - 1) / denominations.back());
+        return inserted;
+    }
+
+    // Breaks an amount the customer typed into coins and bills, largest first; false if the
+    // denominations cannot add up to it exactly
+    bool coinsFor(long long amountCents, vector<int>& inserted) const {
+        inserted.assign(denominations.size(), 0);
+        for (size_t i = denominations.size(); i-- > 0 && amountCents > 0;) {
+            inserted[i] = static_cast<int>(amountCents / denominations[i]);
+            amountCents -= static_cast<long long>(inserted[i]) * denominations[i];
+        }
+        return amountCents == 0;
+    }
+
+    void displayStats() const {
+        lock_guard<mutex> lock(cashMutex);
+        cout << "Cash: " << cashSales << " sales, " << refusedSales << " refused; hoppers:";
+        for (size_t i = 0; i < denominations.size(); ++i) {
+            cout << " " << denominations[i] << "c x" << stock[i];
+        }
+        cout << endl;
+    }
+
+    void displayChange(const vector<int>& counts) const {
+        bool any = false;
+        for (size_t i = denominations.size(); i-- > 0;) {
+            if (i < counts.size() && counts[i] > 0) {
+                cout << (any ? ", " : "") << counts[i] << " x $" << fixed << setprecision(2)
+                     << denominations[i] / 100.0;
+                any = true;
+            }
+        }
+        cout << (any ? "" : "none") << endl;
+    }
+
+    // Parses "1,5,10,25,100" (cents)
+    static vector<int> parseDenominations(const string& list) {
+        vector<int> result;
+        size_t start = 0;
+        while (start < list.size()) {
+            size_t comma = list.find(',', start);
+            if (comma == string::npos) comma = list.size();
+            result.push_back(atoi(list.substr(start, comma - start).c_str()));
+            start = comma + 1;
+        }
+        return result;
+    }
+};
+
+const int ChangeMaker::NO_SOLUTION;  // bound to a reference when the tables are filled
+
+enum PaymentStatus {
+    PAYMENT_PENDING,
+    PAYMENT_APPROVED,
+    PAYMENT_DECLINED
+};
+
+struct PaymentRequest {
+    unsigned long long ticket;    // chosen by the caller, echoed back with the result
+    double amount;
+    unsigned long long customer;  // 0 = anonymous
+};
+
+// Payment listener interface - receives authorization results
+class PaymentListener {
+public:
+    virtual void onPaymentResult(unsigned long long ticket, PaymentStatus status) = 0;
+    virtual ~PaymentListener() {}
+};
+
+// Payment gateway interface - authorizes asynchronously. authorize() returns at once; the
+// gateway calls listener.onPaymentResult exactly once per request, from any thread.
+class PaymentGateway {
+public:
+    virtual void authorize(const PaymentRequest& request, PaymentListener& listener) = 0;
+    virtual ~PaymentGateway() {}
+};
+
+// Simulated payment gateway class - local stand-in for a card processor. Each request is
+// answered after latency plus up to jitter milliseconds; declineRate of them are declined.
+// Any number of requests can be in flight, like a real network round trip.
+class SimulatedPaymentGateway : public PaymentGateway {
+private:
+    struct Pending {
+        chrono::steady_clock::time_point due;
+        PaymentRequest request;
+        PaymentListener* listener;
+        bool approved;
+
+        bool operator>(const Pending& other) const { return due > other.due; }
+    };
+
+    double latencyMs;
+    double jitterMs;
+    double declineRate;
+    mutex gatewayMutex;
+    condition_variable wakeUp;
+    priority_queue<Pending, vector<Pending>, greater<Pending>> pending;
+    mt19937_64 rng;
+    bool running;
+    thread responder;
+
+    void respondLoop() {
+        unique_lock<mutex> lock(gatewayMutex);
+        while (running || !pending.empty()) {
+            if (pending.empty()) {
+                wakeUp.wait(lock);
+                continue;
+            }
+            if (chrono::steady_clock::now() < pending.top().due) {
+                wakeUp.wait_until(lock, pending.top().due);
+                continue;
+            }
+            Pending next = pending.top();
+            pending.pop();
+            lock.unlock();
+            next.listener->onPaymentResult(next.request.ticket, next.approved ? PAYMENT_APPROVED : PAYMENT_DECLINED);
+            lock.lock();
+        }
+    }
+
+public:
+    SimulatedPaymentGateway(double latencyMs, double jitterMs = 0.0, double declineRate = 0.0, unsigned long seed = 1)
+        : latencyMs(max(0.0, latencyMs)), jitterMs(max(0.0, jitterMs)), declineRate(declineRate),
+          rng(seed), running(true) {
+        responder = thread(&SimulatedPaymentGateway::respondLoop, this);
+    }
+
+    // Answers every outstanding request before returning
+    ~SimulatedPaymentGateway() {
+        {
+            lock_guard<mutex> lock(gatewayMutex);
+            running = false;
+        }
+        wakeUp.notify_all();
+        responder.join();
+    }
+
+    void authorize(const PaymentRequest& request, PaymentListener& listener) override {
+        {
+            lock_guard<mutex> lock(gatewayMutex);
+            double delay = latencyMs + uniform_real_distribution<double>(0.0, jitterMs)(rng);
+            bool approved = uniform_real_distribution<double>(0.0, 1.0)(rng) >= declineRate;
+            pending.push(Pending{chrono::steady_clock::now() +
+                                     chrono::duration_cast<chrono::steady_clock::duration>(
+                                         chrono::duration<double, milli>(delay)),
+                                 request, &listener, approved});
+        }
+        wakeUp.notify_one();
+    }
+};
+
+// Payment waiter class - blocks one caller until its single authorization is answered
+class PaymentWaiter : public PaymentListener {
+private:
+    mutex waiterMutex;
+    condition_variable answered;
+    PaymentStatus status;
+
+public:
+    PaymentWaiter() : status(PAYMENT_PENDING) {}
+
+    void onPaymentResult(unsigned long long, PaymentStatus result) override {
+        lock_guard<mutex> lock(waiterMutex);
+        status = result;
+        answered.notify_all();
+    }
+
+    PaymentStatus wait() {
+        unique_lock<mutex> lock(waiterMutex);
+        answered.wait(lock, [this]() { return status != PAYMENT_PENDING; });
+        return status;
+    }
+};
+
+// Request classes for admission control, most important first
+enum RequestPriority {
+    PRIORITY_PURCHASE,  // customer baskets
+    PRIORITY_RESTOCK,   // operator stock changes
+    PRIORITY_REPORT,    // operator reports such as displayProducts
+    PRIORITY_COUNT
+};
+
+// Admission controller class - bounds the requests running against one machine. Up to
+// limit requests run at once; the rest wait in per-priority queues with depth limits and
+// are admitted highest priority first. A request is shed when its queue is full or when it
+// has waited maxWait since it arrived, so latency stays bounded under overload instead of
+// queues growing without end. The limit adapts to measured service time: it shrinks while
+// the window average is above target and grows while below target and saturated.
+class AdmissionController {
+private:
+    static const long WINDOW = 256;  // completions per limit adjustment
+
+    atomic<int> inFlight;
+    atomic<int> limit;
+    atomic<int> waiting;  // queued requests across all classes
+    int minLimit;
+    int maxLimit;
+    long long targetNanos;
+    chrono::steady_clock::duration maxWait;
+    int queueDepth[PRIORITY_COUNT];
+    int queued[PRIORITY_COUNT];  // guarded by queueMutex
+    mutex queueMutex;
+    condition_variable turn[PRIORITY_COUNT];
+
+    atomic<long> windowCount;
+    atomic<long long> windowNanos;
+    atomic<bool> windowSaturated;  // some request found the limit reached during the window
+    atomic<long> admitted[PRIORITY_COUNT];
+    atomic<long> queuedAdmits[PRIORITY_COUNT];  // admitted after waiting
+    atomic<long> shedFull[PRIORITY_COUNT];
+    atomic<long> shedLate[PRIORITY_COUNT];
+    atomic<int> lowestLimit;
+    atomic<int> highestLimit;
+
+    bool tryTake() {
+        int current = inFlight.load();
+        while (current < limit.load()) {
+            if (inFlight.compare_exchange_weak(current, current + 1)) return true;
+        }
+        return false;
+    }
+
+    bool higherQueued(RequestPriority priority) const {
+        for (int c = 0; c < priority; ++c) {
+            if (queued[c] > 0) return true;
+        }
+        return false;
+    }
+
+    // Wakes one waiter of the most important non-empty class. Caller holds queueMutex.
+    void wakeNext() {
+        for (int c = 0; c < PRIORITY_COUNT; ++c) {
+            if (queued[c] > 0) {
+                turn[c].notify_one();
+                return;
+            }
+        }
+    }
+
+    // Additive increase while below target and saturated, multiplicative decrease above it
+    void adjustLimit(long long averageNanos, bool saturated) {
+        int current = limit.load();
+        int next = current;
+        if (averageNanos > targetNanos) {
+            next = max(minLimit, current * 9 / 10);
+        } else if (saturated) {
+            next = min(maxLimit, current + 1);
+        }
+        if (next == current) return;
+        limit.store(next);
+        lowestLimit.store(min(lowestLimit.load(), next));
+        highestLimit.store(max(highestLimit.load(), next));
+        if (next > current && waiting.load() > 0) {
+            lock_guard<mutex> lock(queueMutex);
+            wakeNext();
+        }
+    }
+
+public:
+    AdmissionController(int initialLimit, int maxLimit, double targetMicros, double maxWaitMicros, int queueDepthLimit)
+        : inFlight(0), waiting(0), minLimit(1), maxLimit(max(maxLimit, 1)),
+          targetNanos(static_cast<long long>(targetMicros * 1000.0)),
+          maxWait(chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, micro>(maxWaitMicros))),
+          windowCount(0), windowNanos(0), windowSaturated(false) {
+        int start = min(max(initialLimit, minLimit), this->maxLimit);
+        limit.store(start);
+        lowestLimit.store(start);
+        highestLimit.store(start);
+        queueDepth[PRIORITY_PURCHASE] = max(queueDepthLimit, 0);
+        queueDepth[PRIORITY_RESTOCK] = max(queueDepthLimit / 8, 1);  // operators get short queues
+        queueDepth[PRIORITY_REPORT] = max(queueDepthLimit / 8, 1);
+        for (int c = 0; c < PRIORITY_COUNT; ++c) {
+            queued[c] = 0;
+            admitted[c].store(0);
+            queuedAdmits[c].store(0);
+            shedFull[c].store(0);
+            shedLate[c].store(0);
+        }
+    }
+
+    // Admits a request that arrived at the given time, waiting for a turn if the machine is at
+    // its limit. False means the request was shed and must not run; true must be paired with
+    // finish().
+    bool admit(RequestPriority priority, chrono::steady_clock::time_point arrival) {
+        chrono::steady_clock::time_point deadline = arrival + maxWait;
+        if (chrono::steady_clock::now() >= deadline) {
+            shedLate[priority].fetch_add(1, memory_order_relaxed);  // already waited too long upstream
+            return false;
+        }
+        if (waiting.load() == 0 && tryTake()) {
+            admitted[priority].fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+        windowSaturated.store(true, memory_order_relaxed);
+
+        unique_lock<mutex> lock(queueMutex);
+        if (queued[priority] >= queueDepth[priority]) {
+            shedFull[priority].fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        queued[priority]++;
+        waiting.fetch_add(1);
+        // Checked under the lock after announcing the wait, so a finish() that misses the
+        // announcement leaves a free slot that this check sees
+        bool granted = turn[priority].wait_until(lock, deadline, [this, priority]() {
+            return !higherQueued(priority) && tryTake();
+        });
+        queued[priority]--;
+        waiting.fetch_sub(1);
+        if (inFlight.load() < limit.load()) {
+            wakeNext();  // pass on a wakeup this request may have consumed while timing out
+        }
+        if (!granted) {
+            shedLate[priority].fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        admitted[priority].fetch_add(1, memory_order_relaxed);
+        queuedAdmits[priority].fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    // Ends an admitted request that started running at admittedAt and hands its slot on
+    void finish(chrono::steady_clock::time_point admittedAt) {
+        long long nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - admittedAt).count();
+        inFlight.fetch_sub(1);
+        if (waiting.load() > 0) {
+            lock_guard<mutex> lock(queueMutex);
+            wakeNext();
+        }
+
+        windowNanos.fetch_add(nanos, memory_order_relaxed);
+        if (windowCount.fetch_add(1, memory_order_relaxed) + 1 == WINDOW) {
+            long long total = windowNanos.exchange(0, memory_order_relaxed);
+            long count = windowCount.exchange(0, memory_order_relaxed);
+            adjustLimit(total / max(count, 1L), windowSaturated.exchange(false, memory_order_relaxed));
+        }
+    }
+
+    int getLimit() const { return limit.load(); }
+
+    long getShed(RequestPriority priority) const {
+        return shedFull[priority].load() + shedLate[priority].load();
+    }
+
+    void displayStats() const {
+        static const char* const names[PRIORITY_COUNT] = {"Purchases", "Restocks", "Reports"};
+        cout << "Admission control: limit " << getLimit() << " (ranged " << lowestLimit.load() << "-"
+             << highestLimit.load() << "), queue depth " << queueDepth[PRIORITY_PURCHASE] << "/"
+             << queueDepth[PRIORITY_RESTOCK] << "/" << queueDepth[PRIORITY_REPORT] << endl;
+        for (int c = 0; c < PRIORITY_COUNT; ++c) {
+            cout << "  " << names[c] << ": " << admitted[c].load() << " admitted ("
+                 << queuedAdmits[c].load() << " after queueing), shed " << shedFull[c].load()
+                 << " on full queue, " << shedLate[c].load() << " past deadline" << endl;
+        }
+    }
+};
+
+// Varint helpers for the replication wire format and trace files. Small numbers take one byte;
+// signed deltas are zigzag-encoded so small decreases stay small too.
+class ReplicationCodec {
+public:
+    static void putVarint(vector<unsigned char>& out, unsigned long long value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<unsigned char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<unsigned char>(value));
+    }
+
+    static void putSigned(vector<unsigned char>& out, long long value) {
+        putVarint(out, (static_cast<unsigned long long>(value) << 1) ^ static_cast<unsigned long long>(value >> 63));
+    }
+
+    static bool getVarint(const unsigned char*& position, const unsigned char* end, unsigned long long& value) {
+        value = 0;
+        for (int shift = 0; position < end && shift < 64; shift += 7) {
+            unsigned char byte = *position++;
+            value |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) return true;
+        }
+        return false;  // truncated message
+    }
+
+    static bool getSigned(const unsigned char*& position, const unsigned char* end, long long& value) {
+        unsigned long long raw;
+        if (!getVarint(position, end, raw)) return false;
+        value = static_cast<long long>(raw >> 1) ^ -static_cast<long long>(raw & 1);
+        return true;
+    }
+
+    static long long toCents(double price) { return llround(price * 100.0); }
+};
+
+// Request kinds in a trace file; the first byte of every record
+enum TraceRecordType : unsigned char {
+    TRACE_PURCHASE,
+    TRACE_RESTOCK,
+    TRACE_REPRICE,
+    TRACE_DISPLAY,
+    TRACE_RELEASE  // reserved units put back after a declined payment
+};
+
+// Trace recorder class - captures every request hitting a machine into a compact binary
+// file that TraceReplayer can drive again. A record is its type byte, the microseconds since
+// the previous record, the calling thread and the request's fields, all as varints, so a
+// purchase usually takes 6 bytes. Records go into an in-memory block under a short lock; the
+// thread that fills a block writes it out, and blocks reach the file in order.
+class TraceRecorder {
+private:
+    static const size_t BLOCK_BYTES = 1 << 16;
+
+    ofstream file;
+    mutex bufferMutex;
+    mutex fileMutex;  // held while a block is written; taken before the buffers are swapped
+    vector<unsigned char> buffer;
+    vector<unsigned char> spare;
+    chrono::steady_clock::time_point last;
+    atomic<long> records;
+
+    // Small per-thread ids, so a replay can keep each caller's requests in order
+    static unsigned threadId() {
+        static atomic<unsigned> nextId(0);
+        static thread_local unsigned id = nextId.fetch_add(1);
+        return id;
+    }
+
+    // Starts a record; caller holds bufferMutex
+    void begin(TraceRecordType type) {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        buffer.push_back(type);
+        ReplicationCodec::putVarint(buffer, chrono::duration_cast<chrono::microseconds>(now - last).count());
+        ReplicationCodec::putVarint(buffer, threadId());
+        last = now;
+    }
+
+    // Ends a record and writes the block if it is full; releases lock
+    void end(unique_lock<mutex>& lock) {
+        records.fetch_add(1, memory_order_relaxed);
+        if (buffer.size() < BLOCK_BYTES) return;
+        lock_guard<mutex> writing(fileMutex);
+        buffer.swap(spare);
+        buffer.clear();
+        lock.unlock();
+        file.write(reinterpret_cast<const char*>(spare.data()), spare.size());
+    }
+
+public:
+    static const char* magic() { return "VMTRACE1"; }
+
+    // productCount is stored in the header so a replay can check it built the same catalog
+    TraceRecorder(const string& path, size_t productCount)
+        : file(path, ios::binary), last(chrono::steady_clock::now()), records(0) {
+        buffer.reserve(BLOCK_BYTES + 64);
+        spare.reserve(BLOCK_BYTES + 64);
+        buffer.insert(buffer.end(), magic(), magic() + 8);
+        ReplicationCodec::putVarint(buffer, productCount);
+    }
+
+    bool isOpen() const { return file.is_open(); }
+    long getRecordCount() const { return records.load(); }
+
+    void recordPurchase(size_t product, int quantity, unsigned long long requestId) {
+        unique_lock<mutex> lock(bufferMutex);
+        begin(TRACE_PURCHASE);
+        ReplicationCodec::putVarint(buffer, product);
+        ReplicationCodec::putSigned(buffer, quantity);
+        ReplicationCodec::putVarint(buffer, requestId);
+        end(lock);
+    }
+
+    void recordRestock(size_t product, int quantity) {
+        unique_lock<mutex> lock(bufferMutex);
+        begin(TRACE_RESTOCK);
+        ReplicationCodec::putVarint(buffer, product);
+        ReplicationCodec::putSigned(buffer, quantity);
+        end(lock);
+    }
+
+    void recordRelease(size_t product, int quantity) {
+        unique_lock<mutex> lock(bufferMutex);
+        begin(TRACE_RELEASE);
+        ReplicationCodec::putVarint(buffer, product);
+        ReplicationCodec::putSigned(buffer, quantity);
+        end(lock);
+    }
+
+    void recordReprice(const vector<pair<size_t, double>>& changes) {
+        unique_lock<mutex> lock(bufferMutex);
+        begin(TRACE_REPRICE);
+        ReplicationCodec::putVarint(buffer, changes.size());
+        for (const auto& change : changes) {
+            ReplicationCodec::putVarint(buffer, change.first);
+            ReplicationCodec::putSigned(buffer, ReplicationCodec::toCents(change.second));
+        }
+        end(lock);
+    }
+
+    void recordDisplay() {
+        unique_lock<mutex> lock(bufferMutex);
+        begin(TRACE_DISPLAY);
+        end(lock);
+    }
+
+    // Writes everything recorded so far
+    void flush() {
+        lock_guard<mutex> lock(bufferMutex);
+        lock_guard<mutex> writing(fileMutex);
+        file.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+        buffer.clear();
+        file.flush();
+    }
+
+    ~TraceRecorder() {
+        flush();
+    }
+};
+
+// Catalog index class - secondary indexes over final price and category for catalog queries
+// such as "drinks under $2" or "everything on offer". Each index is an ordered set keyed by
+// final price in cents, so a query costs O(log n) plus the number of matches. The machine
+// updates a slot when it is added or repriced; limited-time offers leave every index when
+// they expire, found through a min-heap of expiry times checked on each call. Prices here
+// are before dynamic pricing, which moves with demand rather than through updates.
+class CatalogIndex {
+private:
+    typedef set<pair<long long, size_t>> PriceSet;  // (final price in cents, slot)
+
+    struct Entry {
+        long long cents;
+        CategoryId category;
+        bool onOffer;
+        bool listed;
+    };
+
+    mutable mutex indexMutex;
+    vector<Entry> entries;
+    PriceSet byPrice;
+    vector<PriceSet> byCategory;
+    PriceSet onOffer;
+    priority_queue<pair<time_t, size_t>, vector<pair<time_t, size_t>>, greater<pair<time_t, size_t>>> expiries;
+    long updates;
+    long expired;
+
+    void unlist(size_t slot) {
+        Entry& entry = entries[slot];
+        if (!entry.listed) return;
+        pair<long long, size_t> key(entry.cents, slot);
+        byPrice.erase(key);
+        byCategory[entry.category].erase(key);
+        if (entry.onOffer) onOffer.erase(key);
+        entry.listed = false;
+    }
+
+    // Drops offers whose expiry time has passed. Caller holds indexMutex.
+    void dropExpired(time_t now) {
+        while (!expiries.empty() && expiries.top().first <= now) {
+            size_t slot = expiries.top().second;
+            expiries.pop();
+            if (entries[slot].listed) {
+                unlist(slot);
+                expired++;
+            }
+        }
+    }
+
+    // Lists slot at its final price for base. Caller holds indexMutex.
+    void place(size_t slot, const Product& product, double base) {
+        if (slot > entries.size()) return;  // Added validation
+        if (slot == entries.size()) {
+            entries.push_back(Entry{0, CATEGORY_GENERAL, false, false});
+            if (product.getExpiryTime() != 0) {
+                expiries.push(make_pair(product.getExpiryTime(), slot));
+            }
+        }
+        updates++;
+        Entry& entry = entries[slot];
+        long long cents = priceKey(product, base);
+        bool offer = cents < ReplicationCodec::toCents(base);
+        if (entry.listed && entry.cents == cents && entry.onOffer == offer) return;  // nothing moves
+        unlist(slot);
+        if (product.hasExpired()) return;
+
+        entry.cents = cents;
+        entry.category = product.getCategoryId();
+        entry.onOffer = offer;
+        entry.listed = true;
+        pair<long long, size_t> key(cents, slot);
+        byPrice.insert(key);
+        if (entry.category >= byCategory.size()) {
+            byCategory.resize(entry.category + 1);
+        }
+        byCategory[entry.category].insert(key);
+        if (offer) onOffer.insert(key);
+    }
+
+    // Rebuilds every set from entries in one sorted pass; cheaper than moving most
+    // slots one by one. Caller holds indexMutex.
+    void rebuild() {
+        vector<pair<long long, size_t>> keys;
+        keys.reserve(entries.size());
+        for (size_t slot = 0; slot < entries.size(); ++slot) {
+            if (entries[slot].listed) keys.push_back(make_pair(entries[slot].cents, slot));
+        }
+        sort(keys.begin(), keys.end());
+        byPrice.clear();
+        onOffer.clear();
+        for (auto& index : byCategory) index.clear();
+        for (const auto& key : keys) {
+            const Entry& entry = entries[key.second];
+            byPrice.insert(byPrice.end(), key);
+            byCategory[entry.category].insert(byCategory[entry.category].end(), key);
+            if (entry.onOffer) onOffer.insert(onOffer.end(), key);
+        }
+    }
+
+    static void collect(const PriceSet& index, double minPrice, double maxPrice, vector<size_t>& matches) {
+        long long high = ReplicationCodec::toCents(maxPrice);
+        for (auto it = index.lower_bound(make_pair(ReplicationCodec::toCents(minPrice), size_t(0)));
+             it != index.end() && it->first <= high; ++it) {
+            matches.push_back(it->second);
+        }
+    }
+
+public:
+    CatalogIndex() : updates(0), expired(0) {}
+
+    // Final price in cents and whether it is below the base price, as the indexes see them
+    static long long priceKey(const Product& product, double base) {
+        return ReplicationCodec::toCents(product.calculatePriceAt(base));
+    }
+
+    static bool isOnOffer(const Product& product, double base) {
+        return priceKey(product, base) < ReplicationCodec::toCents(base);
+    }
+
+    // Adds slot or moves it to its new final price; slots are registered in order
+    void update(size_t slot, const Product& product, double base) {
+        lock_guard<mutex> lock(indexMutex);
+        place(slot, product, base);
+    }
+
+    // Moves each (slot, base price) change to its new final price under one lock.
+    // Catalog-wide repricings rewrite the entries and rebuild the sets instead.
+    void reprice(const vector<pair<size_t, double>>& changes, const vector<Product*>& products) {
+        lock_guard<mutex> lock(indexMutex);
+        if (changes.size() * 4 < entries.size()) {
+            for (const auto& change : changes) {
+                if (change.first < entries.size()) {  // Added validation
+                    place(change.first, *products[change.first], change.second);
+                }
+            }
+            return;
+        }
+        for (const auto& change : changes) {
+            if (change.first >= entries.size()) continue;  // Added validation
+            Entry& entry = entries[change.first];
+            if (!entry.listed) continue;  // expired offers stay out
+            entry.cents = priceKey(*products[change.first], change.second);
+            entry.onOffer = entry.cents < ReplicationCodec::toCents(change.second);
+            updates++;
+        }
+        rebuild();
+    }
+
+    size_t getProductCount() const {
+        lock_guard<mutex> lock(indexMutex);
+        return entries.size();
+    }
+
+    // Listed slots with a final price in [minPrice, maxPrice], cheapest first
+    vector<size_t> findByPrice(double minPrice, double maxPrice) {
+        lock_guard<mutex> lock(indexMutex);
+        dropExpired(Clock::now());
+        vector<size_t> matches;
+        collect(byPrice, minPrice, maxPrice, matches);
+        return matches;
+    }
+
+    vector<size_t> findByCategory(CategoryId category, double minPrice, double maxPrice) {
+        lock_guard<mutex> lock(indexMutex);
+        dropExpired(Clock::now());
+        vector<size_t> matches;
+        if (category < byCategory.size()) {
+            collect(byCategory[category], minPrice, maxPrice, matches);
+        }
+        return matches;
+    }
+
+    // Slots selling below their base price (discounts and running offers), cheapest first
+    vector<size_t> findOnOffer(double minPrice, double maxPrice) {
+        lock_guard<mutex> lock(indexMutex);
+        dropExpired(Clock::now());
+        vector<size_t> matches;
+        collect(onOffer, minPrice, maxPrice, matches);
+        return matches;
+    }
+
+    void displayStats() {
+        lock_guard<mutex> lock(indexMutex);
+        cout << "Catalog index: " << byPrice.size() << " of " << entries.size() << " slots listed, "
+             << onOffer.size() << " on offer, " << updates << " updates, " << expired << " offers expired" << endl;
+    }
+};
+
+// Restock monitor class - tracks which slots of a fleet are at or below their low-stock
+// threshold. Machines report every stock change; a change that does not cross the threshold
+// costs one comparison, and a crossing updates the needs-restock sets in O(1) and queues an
+// alert. Restock routes are read from those sets, so nobody has to poll stock levels.
+class RestockMonitor {
+public:
+    struct Alert {
+        size_t machine;  // id returned by registerMachine
+        size_t product;
+        int stock;
+        bool low;        // false when a restock lifted the slot back above its threshold
+        time_t timestamp;
+    };
+
+    // One machine on a restock route and the slots to refill there, in slot order
+    struct RouteStop {
+        size_t machine;
+        string name;
+        vector<size_t> products;
+    };
+
+private:
+    struct Site {
+        string name;
+        vector<int> thresholds;     // low once stock is at or below; -1 never alerts
+        vector<char> low;
+        vector<size_t> lowSlots;    // the machine's needs-restock set, unordered
+        vector<size_t> position;    // index of each low slot in lowSlots
+        size_t routePosition;       // index in lowSites while the machine has low slots
+    };
+
+    mutex monitorMutex;
+    deque<Site> sites;              // deque: sites are referenced by id and only get appended
+    vector<size_t> lowSites;        // machines with at least one low slot, unordered
+    int defaultThreshold;
+    size_t alertCapacity;
+    vector<Alert> alerts;           // crossings not yet drained
+    long lowAlerts;
+    long recoveries;
+    long droppedAlerts;
+
+    // Moves slot in or out of the needs-restock sets. Caller holds monitorMutex.
+    void setLow(Site& site, size_t machine, size_t slot, bool low) {
+        site.low[slot] = low ? 1 : 0;
+        if (low) {
+            site.position[slot] = site.lowSlots.size();
+            site.lowSlots.push_back(slot);
+            if (site.lowSlots.size() == 1) {
+                site.routePosition = lowSites.size();
+                lowSites.push_back(machine);
+            }
+        } else {
+            size_t moved = site.lowSlots.back();
+            site.lowSlots[site.position[slot]] = moved;
+            site.position[moved] = site.position[slot];
+            site.lowSlots.pop_back();
+            if (site.lowSlots.empty()) {
+                size_t last = lowSites.back();
+                lowSites[site.routePosition] = last;
+                sites[last].routePosition = site.routePosition;
+                lowSites.pop_back();
+            }
+        }
+    }
+
+    // Re-evaluates one slot against its threshold. Caller holds the machine's stock lock.
+    void evaluate(size_t machine, size_t slot, int stock) {
+        Site& site = sites[machine];
+        bool low = stock <= site.thresholds[slot];
+        if (low == (site.low[slot] != 0)) return;  // no crossing, no work
+
+        lock_guard<mutex> lock(monitorMutex);
+        setLow(site, machine, slot, low);
+        if (low) {
+            lowAlerts++;
+        } else {
+            recoveries++;
+        }
+        if (alerts.size() < alertCapacity) {
+            alerts.push_back(Alert{machine, slot, stock, low, Clock::now()});
+        } else {
+            droppedAlerts++;  // the needs-restock sets stay exact; only the notification is lost
+        }
+    }
+
+public:
+    RestockMonitor(int defaultThreshold, size_t alertCapacity = 65536)
+        : defaultThreshold(defaultThreshold >= -1 ? defaultThreshold : -1),  // Added validation
+          alertCapacity(alertCapacity), lowAlerts(0), recoveries(0), droppedAlerts(0) {
+        alerts.reserve(alertCapacity);
+    }
+
+    // Adds a machine to the fleet and returns its id. Register machines and their products
+    // during setup, before other threads report stock changes.
+    size_t registerMachine(const string& name) {
+        lock_guard<mutex> lock(monitorMutex);
+        sites.push_back(Site{name, vector<int>(), vector<char>(), vector<size_t>(), vector<size_t>(), 0});
+        return sites.size() - 1;
+    }
+
+    // Adds the machine's next slot at the default threshold
+    void registerProduct(size_t machine, int stock) {
+        if (machine >= sites.size()) return;  // Added validation
+        Site& site = sites[machine];
+        site.thresholds.push_back(defaultThreshold);
+        site.low.push_back(0);
+        site.position.push_back(0);
+        evaluate(machine, site.thresholds.size() - 1, stock);
+    }
+
+    size_t getProductCount(size_t machine) const {
+        return machine < sites.size() ? sites[machine].thresholds.size() : 0;
+    }
+
+    // Call with the machine's stock lock held, like stockChanged
+    void setThreshold(size_t machine, size_t slot, int threshold, int stock) {
+        if (machine >= sites.size() || slot >= sites[machine].thresholds.size() || threshold < -1) return;  // Added validation
+        {
+            lock_guard<mutex> lock(monitorMutex);
+            sites[machine].thresholds[slot] = threshold;
+        }
+        evaluate(machine, slot, stock);
+    }
+
+    // Call after every stock change of the slot, with the machine's stock lock held
+    void stockChanged(size_t machine, size_t slot, int stock) {
+        evaluate(machine, slot, stock);
+    }
+
+    // Moves the queued alerts into drained, oldest first
+    void drainAlerts(vector<Alert>& drained) {
+        drained.clear();
+        lock_guard<mutex> lock(monitorMutex);
+        drained.swap(alerts);
+        alerts.reserve(alertCapacity);
+    }
+
+    size_t getMachinesNeedingRestock() {
+        lock_guard<mutex> lock(monitorMutex);
+        return lowSites.size();
+    }
+
+    // The machine's slots at or below their threshold, in slot order
+    vector<size_t> getProductsNeedingRestock(size_t machine) {
+        lock_guard<mutex> lock(monitorMutex);
+        vector<size_t> slots;
+        if (machine < sites.size()) {
+            slots = sites[machine].lowSlots;
+        }
+        sort(slots.begin(), slots.end());
+        return slots;
+    }
+
+    // One stop per machine that needs restocking, most low slots first (ties by machine id).
+    // Costs O(low slots), however large the fleet.
+    vector<RouteStop> planRoute() {
+        vector<RouteStop> route;
+        {
+            lock_guard<mutex> lock(monitorMutex);
+            route.reserve(lowSites.size());
+            for (size_t machine : lowSites) {
+                route.push_back(RouteStop{machine, sites[machine].name, sites[machine].lowSlots});
+            }
+        }
+        for (RouteStop& stop : route) {
+            sort(stop.products.begin(), stop.products.end());
+        }
+        sort(route.begin(), route.end(), [](const RouteStop& a, const RouteStop& b) {
+            return a.products.size() != b.products.size() ? a.products.size() > b.products.size()
+                                                          : a.machine < b.machine;
+        });
+        return route;
+    }
+
+    void displayStats() {
+        lock_guard<mutex> lock(monitorMutex);
+        size_t lowSlots = 0;
+        for (size_t machine : lowSites) {
+            lowSlots += sites[machine].lowSlots.size();
+        }
+        cout << "Restock monitor: " << lowSlots << " slots on " << lowSites.size() << " of " << sites.size()
+             << " machines need restocking; " << lowAlerts << " low-stock alerts, " << recoveries
+             << " recoveries, " << droppedAlerts << " alerts dropped" << endl;
+    }
+};
+
+// Spiral selection policy: which of a product's spirals a vend turns
+enum SpiralPolicy {
+    SPIRAL_FIRST,     // lowest grid position first, emptying spirals front to back
+    SPIRAL_FULLEST,   // the fullest spiral, spreading wear across motors
+    SPIRAL_EMPTIEST   // the emptiest spiral that still has stock, freeing spirals for reloading
+};
+
+// Planogram class - the physical layout of a machine: a grid of spirals (physical slots),
+// each holding units of one product up to its own capacity. A product can fill several
+// spirals. Per-spiral state lives in flat arrays indexed row * columns + column, and each
+// product's spirals are listed contiguously, so a vend scans one short run. The machine calls
+// load and vend under its stock lock; queries read relaxed atomics and need no lock.
+class Planogram {
+private:
+    size_t rows;
+    size_t columns;
+    SpiralPolicy policy;
+    vector<int> spiralProduct;                  // -1 for an unassigned spiral
+    vector<unsigned short> capacity;
+    unique_ptr<atomic<unsigned short>[]> stock;
+    unique_ptr<atomic<unsigned>[]> vends;
+    vector<size_t> spiralList;                  // spirals grouped by product, in grid order
+    vector<size_t> spiralStart;                 // product p owns spiralList[spiralStart[p], spiralStart[p + 1])
+    vector<size_t> pendingStart;                // like spiralStart, laid out ahead for products from pendingFirst on
+    size_t pendingFirst;
+    bool pendingValid;                          // false once assign changes the grid
+    deque<atomic<int>> overflow;                // stocked units of each product that no spiral holds
+    atomic<size_t> emptySpirals;                // assigned spirals with no units left
+
+    static const size_t NONE = static_cast<size_t>(-1);
+
+    // The product's spiral to vend from under the policy, or NONE when all are empty
+    size_t pick(size_t product) const {
+        size_t best = NONE;
+        for (size_t i = spiralStart[product]; i < spiralStart[product + 1]; ++i) {
+            size_t spiral = spiralList[i];
+            unsigned short units = stock[spiral].load(memory_order_relaxed);
+            if (units == 0) continue;
+            if (policy == SPIRAL_FIRST) return spiral;
+            if (best == NONE) {
+                best = spiral;
+            } else {
+                unsigned short bestUnits = stock[best].load(memory_order_relaxed);
+                if (policy == SPIRAL_FULLEST ? units > bestUnits : units < bestUnits) best = spiral;
+            }
+        }
+        return best;
+    }
+
+    // Writers are serialized by the machine's stock lock, so counters need no atomic
+    // read-modify-write; the atomics only make lock-free readers safe
+    template <typename T>
+    static void add(atomic<T>& counter, T delta) {
+        counter.store(counter.load(memory_order_relaxed) + delta, memory_order_relaxed);
+    }
+
+    // Lays out the spirals of every product not registered yet behind the registered runs,
+    // in one counting-sort pass over the grid; registerProduct then only publishes a run
+    void layOutPending() {
+        size_t first = getProductCount();
+        pendingFirst = first;
+        pendingStart.assign(1, spiralStart.back());
+        for (int product : spiralProduct) {
+            if (product < 0 || static_cast<size_t>(product) < first) continue;
+            size_t run = product - first + 1;
+            if (run >= pendingStart.size()) pendingStart.resize(run + 1, 0);
+            pendingStart[run]++;
+        }
+        for (size_t i = 1; i < pendingStart.size(); ++i) {
+            pendingStart[i] += pendingStart[i - 1];
+        }
+        spiralList.resize(pendingStart.back());
+        vector<size_t> next(pendingStart.begin(), pendingStart.end() - 1);
+        for (size_t spiral = 0; spiral < spiralProduct.size(); ++spiral) {
+            int product = spiralProduct[spiral];
+            if (product < 0 || static_cast<size_t>(product) < first) continue;
+            spiralList[next[product - first]++] = spiral;  // grid order within each run
+        }
+        pendingValid = true;
+    }
+
+    void setStock(size_t spiral, unsigned short units) {
+        unsigned short before = stock[spiral].load(memory_order_relaxed);
+        stock[spiral].store(units, memory_order_relaxed);
+        if (before == 0 && units > 0) {
+            add<size_t>(emptySpirals, static_cast<size_t>(-1));
+        } else if (before > 0 && units == 0) {
+            add<size_t>(emptySpirals, 1);
+        }
+    }
+
+public:
+    Planogram(size_t rows, size_t columns, SpiralPolicy policy = SPIRAL_FIRST)
+        : rows(rows), columns(columns), policy(policy), spiralProduct(rows * columns, -1),
+          capacity(rows * columns, 0), stock(new atomic<unsigned short>[rows * columns]),
+          vends(new atomic<unsigned>[rows * columns]), spiralStart(1, 0), pendingFirst(0), pendingValid(false), emptySpirals(0) {
+        for (size_t i = 0; i < rows * columns; ++i) {
+            stock[i].store(0);
+            vends[i].store(0);
+        }
+    }
+
+    // Puts product in the spiral at (row, column). Lay out a product's spirals before the
+    // product is registered; false if the position is outside the grid or already taken.
+    bool assign(size_t row, size_t column, size_t product, unsigned short spiralCapacity) {
+        if (row >= rows || column >= columns || spiralCapacity == 0) return false;  // Added validation
+        size_t spiral = row * columns + column;
+        if (spiralProduct[spiral] != -1 || product < getProductCount()) return false;  // Added validation
+        spiralProduct[spiral] = static_cast<int>(product);
+        capacity[spiral] = spiralCapacity;
+        emptySpirals++;
+        pendingValid = false;
+        return true;
+    }
+
+    // Lays products 0..productCount-1 out row by row, one spiral each, then gives the
+    // spirals left over to the first products again
+    void assignInOrder(size_t productCount, unsigned short spiralCapacity) {
+        if (productCount == 0) return;  // Added validation
+        for (size_t spiral = 0; spiral < rows * columns; ++spiral) {
+            assign(spiral / columns, spiral % columns, spiral % productCount, spiralCapacity);
+        }
+    }
+
+    // Called by the machine for each product slot in order, with its stock. The grid is
+    // scanned once per layout, not once per product.
+    void registerProduct(int units) {
+        if (!pendingValid) {
+            layOutPending();
+        }
+        size_t product = getProductCount();
+        size_t next = product - pendingFirst + 1;
+        spiralStart.push_back(next < pendingStart.size() ? pendingStart[next] : spiralStart.back());  // no spirals past the last run
+        overflow.emplace_back(0);
+        load(product, units);
+    }
+
+    size_t getProductCount() const { return overflow.size(); }
+
+    // Fills the product's spirals in grid order up to capacity; the rest overflows
+    void load(size_t product, int units) {
+        if (product >= getProductCount() || units <= 0) return;  // Added validation
+        for (size_t i = spiralStart[product]; i < spiralStart[product + 1] && units > 0; ++i) {
+            size_t spiral = spiralList[i];
+            unsigned short held = stock[spiral].load(memory_order_relaxed);
+            int room = min(units, static_cast<int>(capacity[spiral]) - held);
+            if (room > 0) {
+                setStock(spiral, static_cast<unsigned short>(held + room));
+                units -= room;
+            }
+        }
+        add(overflow[product], units);
+    }
+
+    // Takes units from the product's spirals by policy. Overflow units move into a spiral
+    // as it empties, so spirals only run dry once the overflow is gone.
+    void vend(size_t product, int units) {
+        if (product >= getProductCount() || units <= 0) return;  // Added validation
+        while (units > 0) {
+            size_t spiral = pick(product);
+            if (spiral == NONE) {
+                add(overflow[product], -units);
+                return;
+            }
+            unsigned short held = stock[spiral].load(memory_order_relaxed);
+            int taken = policy == SPIRAL_FULLEST ? 1 : min(units, static_cast<int>(held));
+            int refill = min(taken, overflow[product].load(memory_order_relaxed));
+            if (refill > 0) {
+                add(overflow[product], -refill);
+            }
+            setStock(spiral, static_cast<unsigned short>(held - taken + refill));
+            add(vends[spiral], static_cast<unsigned>(taken));
+            units -= taken;
+        }
+    }
+
+    size_t getRows() const { return rows; }
+    size_t getColumns() const { return columns; }
+    SpiralPolicy getPolicy() const { return policy; }
+
+    // Product in the spiral at (row, column), or -1 for an unassigned or out-of-grid spiral
+    int getSpiralProduct(size_t row, size_t column) const {
+        return row < rows && column < columns ? spiralProduct[row * columns + column] : -1;
+    }
+
+    int getSpiralStock(size_t row, size_t column) const {
+        return row < rows && column < columns ? stock[row * columns + column].load(memory_order_relaxed) : 0;
+    }
+
+    int getSpiralCapacity(size_t row, size_t column) const {
+        return row < rows && column < columns ? capacity[row * columns + column] : 0;
+    }
+
+    // Units vended from the spiral since the planogram was built
+    unsigned getSpiralVends(size_t row, size_t column) const {
+        return row < rows && column < columns ? vends[row * columns + column].load(memory_order_relaxed) : 0;
+    }
+
+    size_t getEmptySpiralCount() const { return emptySpirals.load(memory_order_relaxed); }
+
+    // Grid positions (row * columns + column) of the product's spirals, in grid order
+    vector<size_t> getProductSpirals(size_t product) const {
+        if (product >= getProductCount()) return vector<size_t>();  // Added validation
+        return vector<size_t>(spiralList.begin() + spiralStart[product], spiralList.begin() + spiralStart[product + 1]);
+    }
+
+    int getOverflow(size_t product) const {
+        return product < getProductCount() ? overflow[product].load(memory_order_relaxed) : 0;
+    }
+
+    // Units of the product held in its spirals and in overflow
+    int getUnits(size_t product) const {
+        int units = getOverflow(product);
+        for (size_t spiral : getProductSpirals(product)) {
+            units += stock[spiral].load(memory_order_relaxed);
+        }
+        return units;
+    }
+
+    static const char* policyName(SpiralPolicy policy) {
+        switch (policy) {
+        case SPIRAL_FULLEST: return "fullest";
+        case SPIRAL_EMPTIEST: return "emptiest";
+        default: return "first";
+        }
+    }
+
+    // Prints the grid as the operator sees it: position, product slot and stock/capacity
+    void displayGrid() const {
+        cout << "Planogram: " << rows << "x" << columns << " spirals, " << getEmptySpiralCount()
+             << " empty, " << policyName(policy) << "-spiral vending" << endl;
+        for (size_t row = 0; row < rows; ++row) {
+            cout << " ";
+            for (size_t column = 0; column < columns; ++column) {
+                size_t spiral = row * columns + column;
+                cout << " " << static_cast<char>('A' + row % 26) << column + 1;
+                if (spiralProduct[spiral] < 0) {
+                    cout << ":--";
+                } else {
+                    cout << ":#" << spiralProduct[spiral] + 1 << " " << stock[spiral].load(memory_order_relaxed)
+                         << "/" << capacity[spiral];
+                }
+            }
+            cout << endl;
+        }
+    }
+};
+
+const size_t Planogram::NONE;
+
+// Replication log class - remembers which slots changed since the last replication batch.
+// Marking is O(1) and allocation-free once slots are registered, so it can sit on the
+// purchase path; each slot is queued at most once per batch however often it changes.
+class ReplicationLog {
+private:
+    deque<atomic<unsigned char>> dirty;  // deque: atomics cannot move, and slots only get appended
+    mutex listMutex;
+    vector<size_t> changed;  // slots marked since the last take()
+
+public:
+    // Call during catalog setup, before the slot can be marked
+    void registerProduct() {
+        dirty.emplace_back(0);
+        lock_guard<mutex> lock(listMutex);
+        changed.reserve(dirty.size());
+    }
+
+    size_t getProductCount() const { return dirty.size(); }
+
+    // Call after the slot's stock or base price has changed
+    void markChanged(size_t index) {
+        if (index >= dirty.size() || dirty[index].exchange(1) != 0) return;
+        lock_guard<mutex> lock(listMutex);
+        changed.push_back(index);
+    }
+
+    // Moves the changed slots into slots in ascending order and clears their marks.
+    // Read slot values after this returns: a change racing with the take either lands
+    // before the read or marks the slot again for the next batch.
+    void take(vector<size_t>& slots) {
+        slots.clear();
+        {
+            lock_guard<mutex> lock(listMutex);
+            slots.swap(changed);
+            changed.reserve(dirty.size());
+        }
+        sort(slots.begin(), slots.end());
+        for (size_t index : slots) {
+            dirty[index].store(0);
+        }
+    }
+};
+
+// VendingMachine class manages the product inventory
+class VendingMachine {
+private:
+    string name;
+    vector<Product*> products;
+    bool verbose;
+    mutex stockMutex;  // serializes stock check + decrement across purchase threads
+    mutex repriceMutex;  // one repricing at a time; readers never take it
+    PriceTableManager prices;
+    SalesAnalytics* analytics;
+    DynamicPricingEngine* pricingEngine;
+    const PromotionEngine* promotions;
+    ReceiptPrinter* receipts;
+    atomic<long> unprintedWarnings;  // stock warnings raised with no receipt printer attached
+    SalesEventBus* eventBus;
+    SalesSketches* sketches;
+    TopSellerTracker* topSellers;
+    ReplicationLog* replication;
+    PaymentGateway* payments;
+    ChangeMaker* cashBox;
+    IdempotencyTable* requests;
+    TraceRecorder* trace;
+    CatalogIndex* catalogIndex;
+    RestockMonitor* restockMonitor;
+    size_t restockSite;  // this machine's id in restockMonitor
+    Planogram* planogram;
+    vector<char> expiryReported;  // one flag per slot, guarded by stockMutex
+
+    // Publishes an expiry event the first time an expired slot is seen. Caller holds stockMutex.
+    bool noteExpiry(size_t index, SalesEvent& event) {
+        if (eventBus == nullptr || expiryReported[index] || !products[index]->hasExpired()) return false;
+        expiryReported[index] = 1;
+        event = SalesEvent{SALES_EVENT_EXPIRY, products[index]->getCategoryId(), 0,
+                           products[index]->getStockQuantity(), index, 0.0, Clock::now(), 0};
+        return true;
+    }
+
+    // Sends a receipt/log line to the background printer, or prints it directly if none is
+    // attached; for the interactive checkout, not the purchase path
+    void report(const ReceiptEvent& event) {
+        if (receipts != nullptr) {
+            receipts->enqueue(event);
+        } else {
+            ReceiptPrinter::format(cout, event);
+            cout.flush();
+        }
+    }
+
+    // Purchase-path warnings go to the background printer. Without one they are only counted,
+    // so a purchase never waits on the console.
+    void warn(const ReceiptEvent& event) {
+        if (receipts != nullptr) {
+            receipts->enqueue(event);
+        } else {
+            unprintedWarnings.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    // Flushes pending receipt output before talking to the user
+    void flushReceipts() {
+        if (receipts != nullptr) {
+            receipts->flush();
+        }
+    }
+
+    // Base price of a slot from the published price table; addProduct lists every slot there
+    double currentBasePrice(size_t index) const {
+        return prices.read()->basePrices[index];
+    }
+
+    // Lists a slot in the catalog index at its current base price
+    void indexSlot(size_t index) {
+        double base;
+        {
+            RcuReadGuard guard;
+            base = currentBasePrice(index);
+        }
+        catalogIndex->update(index, *products[index], base);
+    }
+
+    // The find queries answered by scanning every slot, for machines without a catalog index
+    vector<size_t> scanCatalog(double minPrice, double maxPrice, const CategoryId* category, bool onOfferOnly) const {
+        long long low = ReplicationCodec::toCents(minPrice);
+        long long high = ReplicationCodec::toCents(maxPrice);
+        vector<pair<long long, size_t>> matches;
+        RcuReadGuard guard;
+        for (size_t i = 0; i < products.size(); ++i) {
+            const Product& product = *products[i];
+            if (product.hasExpired()) continue;
+            if (category != nullptr && product.getCategoryId() != *category) continue;
+            double base = currentBasePrice(i);
+            long long cents = CatalogIndex::priceKey(product, base);
+            if (cents < low || cents > high) continue;
+            if (onOfferOnly && !CatalogIndex::isOnOffer(product, base)) continue;
+            matches.push_back(make_pair(cents, i));
+        }
+        sort(matches.begin(), matches.end());
+        vector<size_t> slots(matches.size());
+        for (size_t i = 0; i < matches.size(); ++i) {
+            slots[i] = matches[i].second;
+        }
+        return slots;
+    }
+
+    // Takes quantity units out of a slot under the stock lock and describes the line in sale.
+    // recordVelocity feeds the pricing engine while the lock still serializes its updates.
+    bool takeStock(size_t index, int quantity, SalesEvent& sale, bool recordVelocity) {
+        Product* product = products[index];
+        int shortOf = -1;  // stock left when the line could not be filled
+        {
+            lock_guard<mutex> lock(stockMutex);
+            if (!product->isAvailable()) {
+                if (!noteExpiry(index, sale)) return false;
+            } else if (!product->tryPurchase(quantity)) {
+                if (quantity <= 0) return false;
+                shortOf = product->getStockQuantity();
+            } else {
+                sale = SalesEvent{SALES_EVENT_SALE, product->getCategoryId(), quantity,
+                                  product->getStockQuantity(), index, unitPrice(index) * quantity, Clock::now(), 0};
+                if (restockMonitor != nullptr) {
+                    restockMonitor->stockChanged(restockSite, index, sale.stockAfter);
+                }
+                if (planogram != nullptr) {
+                    planogram->vend(index, quantity);
+                }
+                if (recordVelocity && pricingEngine != nullptr && eventBus == nullptr) {
+                    pricingEngine->recordSale(index, quantity, sale.stockAfter, sale.timestamp);
+                }
+            }
+        }
+        if (shortOf >= 0) {
+            warn(ReceiptEvent{RECEIPT_OUT_OF_STOCK, &product->getName(), nullptr, quantity, shortOf, 0.0});
+            return false;
+        }
+        if (sale.type == SALES_EVENT_EXPIRY) {
+            eventBus->publish(sale);  // first sighting of an expired offer; the purchase still fails
+            return false;
+        }
+        if (replication != nullptr) {
+            replication->markChanged(index);
+        }
+        return true;
+    }
+
+    // Asks for cash at the prompt and pays out change; false if the payment was refused
+    bool collectCash(double total) {
+        double tendered;
+        cout << "Amount due: $" << fixed << setprecision(2) << total << ". Insert cash: $";
+        cin >> tendered;
+        vector<int> inserted, change;
+        if (!cashBox->coinsFor(llround(tendered * 100.0), inserted) ||
+            !cashBox->acceptPayment(inserted, llround(total * 100.0), change)) {
+            cout << "Payment refused (not enough inserted, or no change available). Cash returned." << endl;
+            return false;
+        }
+        cout << "Change: ";
+        cashBox->displayChange(change);
+        return true;
+    }
+
+    // Feeds a sold line to the bus, or straight to the attached stores
+    void recordSaleLine(const SalesEvent& sale) {
+        if (eventBus != nullptr) {
+            eventBus->publish(sale);
+        } else {
+            if (analytics != nullptr) {
+                analytics->recordSale(sale.product, sale.quantity, sale.amount, sale.timestamp);
+            }
+            if (topSellers != nullptr) {
+                topSellers->recordSale(sale.product, sale.quantity, sale.timestamp);
+            }
+        }
+    }
+
+public:
+    VendingMachine(const string& name) : name(name), verbose(true), analytics(nullptr), pricingEngine(nullptr), promotions(nullptr), receipts(nullptr), unprintedWarnings(0), eventBus(nullptr), sketches(nullptr), topSellers(nullptr), replication(nullptr), payments(nullptr), cashBox(nullptr), requests(nullptr), trace(nullptr), catalogIndex(nullptr), restockMonitor(nullptr), restockSite(0), planogram(nullptr) {}
+
+    // Turn off the per-product "Added ..." line, e.g. for generated catalogs
+    void setVerbose(bool enabled) { verbose = enabled; }
+
+    void addProduct(Product* product) {
+        if (product != nullptr) {  // Added validation
+            products.push_back(product);
+            prices.append(product->getBasePrice());
+            expiryReported.push_back(0);
+            if (analytics != nullptr) {
+                analytics->registerProduct(product->getCategoryId());
+            }
+            if (pricingEngine != nullptr) {
+                pricingEngine->registerProduct(product->getStockQuantity(), Clock::now());
+            }
+            if (replication != nullptr) {
+                replication->registerProduct();
+                replication->markChanged(products.size() - 1);
+            }
+            if (catalogIndex != nullptr) {
+                indexSlot(products.size() - 1);
+            }
+            if (restockMonitor != nullptr) {
+                lock_guard<mutex> lock(stockMutex);
+                restockMonitor->registerProduct(restockSite, product->getStockQuantity());
+            }
+            if (planogram != nullptr) {
+                lock_guard<mutex> lock(stockMutex);
+                planogram->registerProduct(product->getStockQuantity());
+            }
+            if (verbose) {
+                cout << "Added " << product->getName()
+                     << " (" << product->getCategory() << ")" << endl;
+            }
+        }
+    }
+
+    size_t getProductCount() const { return products.size(); }
+
+    // Out-of-stock warnings counted instead of printed, for machines without a receipt printer
+    long getUnprintedWarnings() const { return unprintedWarnings.load(); }
+
+    // Pre-sizes product storage before a bulk load
+    void reserveProducts(size_t count) {
+        products.reserve(count);
+    }
+
+    // Starts feeding successful purchases into an analytics store (not owned by the machine)
+    void attachAnalytics(SalesAnalytics* store) {
+        analytics = store;
+        if (analytics != nullptr) {
+            for (size_t i = analytics->getProductCount(); i < products.size(); ++i) {
+                analytics->registerProduct(products[i]->getCategoryId());
+            }
+        }
+    }
+
+    // Read-only: stock and prices of a slot change through the machine only
+    const Product* getProduct(size_t index) const {
+        return index < products.size() ? products[index] : nullptr;
+    }
+
+    // Category of every slot, in slot order (the planogram promotions are compiled against)
+    vector<CategoryId> getProductCategories() const {
+        vector<CategoryId> categories(products.size());
+        for (size_t i = 0; i < products.size(); ++i) {
+            categories[i] = products[i]->getCategoryId();
+        }
+        return categories;
+    }
+
+    // Compiled promotions applied at checkout; not owned by the machine
+    void attachPromotions(const PromotionEngine* engine) {
+        promotions = engine;
+    }
+
+    // Routes sale, restock, expiry and checkout events through bus instead of calling
+    // SalesTracker, the analytics store and the pricing engine directly; attach those as
+    // bus consumers instead. Attached stores are still used for catalog registration and
+    // price lookups. Not owned by the machine.
+    void attachEventBus(SalesEventBus* bus) {
+        eventBus = bus;
+    }
+
+    // Marks every stock and base price change in log for replication; not owned by the machine
+    void attachReplicationLog(ReplicationLog* log) {
+        replication = log;
+        if (replication != nullptr) {
+            for (size_t i = replication->getProductCount(); i < products.size(); ++i) {
+                replication->registerProduct();
+                replication->markChanged(i);
+            }
+        }
+    }
+
+    // Current stock and base price of the given slots, for replication. Each stock value is
+    // read under the stock lock and each price from the published table.
+    void readReplicatedState(const vector<size_t>& slots, vector<int>& stock, vector<double>& basePrice) {
+        stock.resize(slots.size());
+        basePrice.resize(slots.size());
+        {
+            lock_guard<mutex> lock(stockMutex);
+            for (size_t i = 0; i < slots.size(); ++i) {
+                stock[i] = products[slots[i]]->getStockQuantity();
+            }
+        }
+        RcuReadGuard guard;
+        for (size_t i = 0; i < slots.size(); ++i) {
+            basePrice[i] = currentBasePrice(slots[i]);
+        }
+    }
+
+    // Scans for limited-time offers that expired since the last scan and publishes them
+    size_t publishExpiries() {
+        vector<SalesEvent> expired;
+        {
+            lock_guard<mutex> lock(stockMutex);
+            SalesEvent event;
+            for (size_t i = 0; i < products.size(); ++i) {
+                if (noteExpiry(i, event)) expired.push_back(event);
+            }
+        }
+        for (const SalesEvent& event : expired) {
+            eventBus->publish(event);
+        }
+        return expired.size();
+    }
+
+    // Moves receipt and log formatting to printer's background thread; not owned by the machine
+    void attachReceiptPrinter(ReceiptPrinter* printer) {
+        receipts = printer;
+    }
+
+    // Best-seller tracking fed by every successful purchase; not owned by the machine. With an
+    // event bus attached, register the tracker as a bus consumer instead.
+    void attachTopSellers(TopSellerTracker* tracker) {
+        topSellers = tracker;
+    }
+
+    // Basket statistics fed at checkout; not owned by the machine. With an event bus attached,
+    // register the sketches as a bus consumer instead.
+    void attachSketches(SalesSketches* store) {
+        sketches = store;
+    }
+
+    // Records a finished basket. The checkout receipt line only exists on the background
+    // printer; without one the caller prints its own total as before.
+    void completeBasket(double total, int items, int distinctProducts = 0, unsigned long long customer = 0) {
+        if (eventBus != nullptr) {
+            if (items > 0) {
+                eventBus->publish(SalesEvent{SALES_EVENT_CHECKOUT, CATEGORY_GENERAL, items, 0,
+                                             static_cast<size_t>(distinctProducts), total, Clock::now(), customer});
+            }
+        } else {
+            SalesTracker::recordSale(total);
+            if (sketches != nullptr && items > 0) {
+                sketches->recordBasket(total, distinctProducts, customer);
+            }
+        }
+        if (receipts != nullptr && items > 0) {
+            receipts->enqueue(ReceiptEvent{RECEIPT_CHECKOUT, nullptr, nullptr, items, 0, total});
+        }
+    }
+
+    static int countItems(const vector<BasketLine>& basket) {
+        int items = 0;
+        for (const BasketLine& line : basket) {
+            items += line.quantity;
+        }
+        return items;
+    }
+
+    // Baskets are a handful of lines, so a quadratic scan beats building a set
+    static int countDistinctProducts(const vector<BasketLine>& basket) {
+        int distinct = 0;
+        for (size_t i = 0; i < basket.size(); ++i) {
+            bool seen = false;
+            for (size_t j = 0; j < i && !seen; ++j) {
+                seen = basket[j].product == basket[i].product;
+            }
+            if (!seen) distinct++;
+        }
+        return distinct;
+    }
+
+    // Discount for a completed basket (0 when no promotions are attached)
+    double applyPromotions(const vector<BasketLine>& basket, int* appliedRules = nullptr) const {
+        if (promotions == nullptr || basket.empty()) return 0.0;
+        return promotions->apply(basket.data(), basket.size(), Clock::now(), appliedRules);
+    }
+
+    // Keeps price and category indexes for the find queries below; not owned by the machine.
+    // Attach before other threads start repricing.
+    void attachCatalogIndex(CatalogIndex* index) {
+        catalogIndex = index;
+        if (catalogIndex != nullptr) {
+            for (size_t i = catalogIndex->getProductCount(); i < products.size(); ++i) {
+                indexSlot(i);
+            }
+        }
+    }
+
+    // Slots with a final price (before dynamic pricing) in [minPrice, maxPrice], cheapest
+    // first, leaving out expired offers. O(log n + matches) with a catalog index attached,
+    // a scan of every slot otherwise.
+    vector<size_t> findProductsByPrice(double minPrice, double maxPrice) const {
+        if (catalogIndex != nullptr) return catalogIndex->findByPrice(minPrice, maxPrice);
+        return scanCatalog(minPrice, maxPrice, nullptr, false);
+    }
+
+    vector<size_t> findProductsByCategory(CategoryId category, double minPrice, double maxPrice) const {
+        if (catalogIndex != nullptr) return catalogIndex->findByCategory(category, minPrice, maxPrice);
+        return scanCatalog(minPrice, maxPrice, &category, false);
+    }
+
+    // Slots selling below their base price: discounted items and running offers
+    vector<size_t> findProductsOnOffer(double minPrice = 0.0, double maxPrice = 1e12) const {
+        if (catalogIndex != nullptr) return catalogIndex->findOnOffer(minPrice, maxPrice);
+        return scanCatalog(minPrice, maxPrice, nullptr, true);
+    }
+
+    vector<size_t> findProductsByCategory(CategoryId category) const {
+        vector<size_t> matches;
+        for (size_t i = 0; i < products.size(); ++i) {
+            if (products[i]->getCategoryId() == category) {
+                matches.push_back(i);
+            }
+        }
+        return matches;
+    }
+
+    // Attach before purchases start; the engine is not owned by the machine
+    void attachPricingEngine(DynamicPricingEngine* engine) {
+        pricingEngine = engine;
+        if (pricingEngine != nullptr) {
+            for (size_t i = pricingEngine->getProductCount(); i < products.size(); ++i) {
+                pricingEngine->registerProduct(products[i]->getStockQuantity(), Clock::now());
+            }
+        }
+    }
+
+    // Final unit price of a slot. Lock-free; safe to call while a repricing is published.
+    double unitPrice(size_t index) const {
+        if (index >= products.size()) return 0.0;  // Added validation
+
+        double base;
+        {
+            RcuReadGuard guard;
+            base = currentBasePrice(index);
+        }
+        if (pricingEngine != nullptr) {
+            base *= pricingEngine->multiplier(index, Clock::now());
+        }
+        return products[index]->calculatePriceAt(base);
+    }
+
+    // Publishes a new price table with the given (slot, base price) changes applied.
+    // All changes become visible to purchase and display at the same instant.
+    void repriceProducts(const vector<pair<size_t, double>>& changes) {
+        if (trace != nullptr) {
+            trace->recordReprice(changes);
+        }
+        lock_guard<mutex> lock(repriceMutex);
+        vector<double> next;
+        {
+            RcuReadGuard guard;
+            const PriceTable* table = prices.read();
+            if (table == nullptr) return;  // no slots yet
+            next.assign(table->basePrices.begin(), table->basePrices.begin() + table->slotCount.load());
+        }
+        vector<pair<size_t, double>> repriced;
+        for (const auto& change : changes) {
+            if (change.first < next.size() && change.second >= 0) {  // Added validation
+                if ((replication != nullptr || catalogIndex != nullptr) && next[change.first] != change.second) {
+                    repriced.push_back(change);
+                }
+                next[change.first] = change.second;
+            }
+        }
+        prices.publish(move(next));
+        if (replication != nullptr) {
+            for (const auto& change : repriced) {
+                replication->markChanged(change.first);
+            }
+        }
+        if (catalogIndex != nullptr) {
+            catalogIndex->reprice(repriced, products);
+        }
+    }
+
+    // Function Overloading - the same ways to update a price as Product::updatePrice, for slots
+    void updateProductPrice(size_t index, double newPrice) {
+        repriceProducts(vector<pair<size_t, double>>(1, make_pair(index, newPrice)));
+    }
+
+    void updateProductPrice(size_t index, double newPrice, double discount) {
+        if (newPrice >= 0 && discount >= 0 && discount <= 100) {  // Added validation
+            updateProductPrice(index, PriceCalculator::calculateDiscountedPrice(newPrice, discount));
+        }
+    }
+
+    void updateProductPrice(size_t index, string currency, double newPrice) {
+        if (newPrice >= 0) {  // Added validation
+            updateProductPrice(index, PriceCalculator::convertCurrency(currency, newPrice));
+        }
+    }
+
+    // Non-interactive purchase of a single basket line. Safe to call from several threads.
+    // With an idempotency table attached, a non-zero requestId makes retries safe: repeating
+    // the id returns the first attempt's result and itemTotal without touching stock or sales.
+    bool purchaseProduct(size_t index, int quantity, double& itemTotal, unsigned long long requestId = 0) {
+        if (index >= products.size()) return false;  // Added validation
+        if (trace != nullptr) {
+            trace->recordPurchase(index, quantity, requests != nullptr ? requestId : 0);  // ids only matter with a table
+        }
+
+        IdempotencyTable::Ticket ticket;
+        if (requestId != 0 && requests != nullptr) {
+            bool succeeded;
+            double amount;
+            switch (requests->begin(requestId, Clock::now(), ticket, succeeded, amount)) {
+            case IdempotencyTable::CLAIM_DUPLICATE:
+                itemTotal = amount;
+                return succeeded;
+            case IdempotencyTable::CLAIM_FULL:
+                return false;
+            case IdempotencyTable::CLAIM_NEW:
+                break;
+            }
+        }
+
+        SalesEvent sale;
+        bool succeeded = takeStock(index, quantity, sale, true);
+        if (succeeded) {
+            itemTotal = sale.amount;
+            recordSaleLine(sale);
+        }
+        if (requestId != 0 && requests != nullptr) {
+            requests->complete(ticket, succeeded, succeeded ? sale.amount : 0.0);
+        }
+        return succeeded;
+    }
+
+    // Records every purchase, reservation, restock, repricing and display request to recorder
+    // for later replay; not owned by the machine
+    void attachTraceRecorder(TraceRecorder* recorder) {
+        trace = recorder;
+    }
+
+    // Reports every stock change to monitor, which flags slots that fall to their low-stock
+    // threshold; not owned by the machine. Attach once, before other threads start trading.
+    void attachRestockMonitor(RestockMonitor* monitor) {
+        restockMonitor = monitor;
+        if (restockMonitor != nullptr) {
+            restockSite = restockMonitor->registerMachine(name);
+            lock_guard<mutex> lock(stockMutex);
+            for (size_t i = 0; i < products.size(); ++i) {
+                restockMonitor->registerProduct(restockSite, products[i]->getStockQuantity());
+            }
+        }
+    }
+
+    // Per-slot low-stock threshold: the slot needs restocking once its stock is at or below
+    // it. -1 retires the slot from restock alerts.
+    void setLowStockThreshold(size_t index, int threshold) {
+        if (restockMonitor == nullptr || index >= products.size()) return;  // Added validation
+        lock_guard<mutex> lock(stockMutex);
+        restockMonitor->setThreshold(restockSite, index, threshold, products[index]->getStockQuantity());
+    }
+
+    // Tracks which spirals hold each product's units: restocks load spirals, sales vend from
+    // them by the planogram's policy. Lay the planogram out first; not owned by the machine.
+    // Attach before other threads start trading.
+    void attachPlanogram(Planogram* layout) {
+        planogram = layout;
+        if (planogram != nullptr) {
+            lock_guard<mutex> lock(stockMutex);
+            for (size_t i = planogram->getProductCount(); i < products.size(); ++i) {
+                planogram->registerProduct(products[i]->getStockQuantity());
+            }
+        }
+    }
+
+    // Remembers keyed purchase requests so retries are answered once; not owned by the machine
+    void attachIdempotencyTable(IdempotencyTable* table) {
+        requests = table;
+    }
+
+    // Holds quantity units of a slot for a sale that is not final yet, e.g. while payment is
+    // authorized. The units stay out of stock until commitReservation or releaseReservation;
+    // sale describes the line (amount is the line total) and is what those calls take.
+    bool reserveProduct(size_t index, int quantity, SalesEvent& sale) {
+        if (index >= products.size()) return false;  // Added validation
+        if (trace != nullptr) {
+            trace->recordPurchase(index, quantity, 0);  // a declined payment adds a release record
+        }
+        return takeStock(index, quantity, sale, false);
+    }
+
+    // Counts a reserved line as sold
+    void commitReservation(const SalesEvent& sale) {
+        if (pricingEngine != nullptr && eventBus == nullptr) {
+            lock_guard<mutex> lock(stockMutex);  // the engine relies on the stock lock to serialize updates
+            pricingEngine->recordSale(sale.product, sale.quantity, sale.stockAfter, sale.timestamp);
+        }
+        recordSaleLine(sale);
+    }
+
+    // Puts reserved units back on sale. Stock consumers see the change; sales consumers get a
+    // release event, not a restock.
+    void releaseReservation(const SalesEvent& sale) {
+        if (sale.product >= products.size()) return;  // Added validation
+        if (trace != nullptr) {
+            trace->recordRelease(sale.product, sale.quantity);
+        }
+        returnStock(sale.product, sale.quantity, SALES_EVENT_RELEASE);
+    }
+
+    // Finishes a basket of reserved lines once payment is answered: an approved basket is
+    // sold and completed, a declined one goes back on the shelf
+    void settleBasket(const vector<SalesEvent>& lines, bool approved, double total,
+                      int distinctProducts, unsigned long long customer) {
+        int items = 0;
+        for (const SalesEvent& line : lines) {
+            if (approved) {
+                commitReservation(line);
+            } else {
+                releaseReservation(line);
+            }
+            items += line.quantity;
+        }
+        if (approved) {
+            completeBasket(total, items, distinctProducts, customer);
+        }
+    }
+
+    // Interactive checkout takes cash through box and pays out change; basket lines stay
+    // reserved until the payment is accepted. Takes precedence over a payment gateway.
+    // Not owned by the machine.
+    void attachCashBox(ChangeMaker* box) {
+        cashBox = box;
+    }
+
+    // Interactive checkout authorizes payment through gateway before the sale is final;
+    // basket lines stay reserved meanwhile. Not owned by the machine.
+    void attachPaymentGateway(PaymentGateway* gateway) {
+        payments = gateway;
+    }
+
+    void restockProduct(size_t index, int quantity) {
+        if (index >= products.size()) return;  // Added validation
+        if (trace != nullptr) {
+            trace->recordRestock(index, quantity);
+        }
+        returnStock(index, quantity, SALES_EVENT_RESTOCK);
+    }
+
+private:
+    // Adds units to a slot for a restock or a released reservation
+    void returnStock(size_t index, int quantity, SalesEventType type) {
+        SalesEvent event;
+        {
+            lock_guard<mutex> lock(stockMutex);
+            *products[index] += quantity;
+            event = SalesEvent{type, products[index]->getCategoryId(), quantity,
+                               products[index]->getStockQuantity(), index, 0.0, Clock::now(), 0};
+            if (pricingEngine != nullptr && eventBus == nullptr) {
+                pricingEngine->recordStockChange(index, event.stockAfter);
+            }
+            if (restockMonitor != nullptr) {
+                restockMonitor->stockChanged(restockSite, index, event.stockAfter);
+            }
+            if (planogram != nullptr) {
+                planogram->load(index, quantity);
+            }
+        }
+        if (replication != nullptr) {
+            replication->markChanged(index);
+        }
+        if (eventBus != nullptr) {
+            eventBus->publish(event);
+        }
+    }
+
+public:
+    void displayProducts() const {
+        if (trace != nullptr) {
+            trace->recordDisplay();
+        }
+        cout << "\nProducts in " << name << ":\n" << endl;
+        for (size_t i = 0; i < products.size(); ++i) {
+            cout << i + 1 << ". ";
+            double base;
+            {
+                RcuReadGuard guard;
+                base = currentBasePrice(i);
+            }
+            products[i]->displayInfoAt(base);
+            cout << "   Status: " << (products[i]->isAvailable() ? "Available" : "Unavailable")
+                 << "\n" << endl;
+        }
+    }
+
+    double selectProducts() {
+        double total = 0.0;
+        char continueChoice;
+        bool purchaseMade = false;
+        vector<BasketLine> basket;
+        vector<SalesEvent> reserved;  // lines held until payment is accepted
+        bool holdLines = payments != nullptr || cashBox != nullptr;
+
+        do {
+            int choice;
+            flushReceipts();
+            cout << "Enter product number (1-" << products.size() << "): ";
+            cin >> choice;
+
+            if (choice < 1 || choice > static_cast<int>(products.size())) {
+                cout << "Invalid selection." << endl;
+                continue;
+            }
+
+            if (!products[choice - 1]->isAvailable()) {
+                cout << "Product currently unavailable." << endl;
+                continue;
+            }
+
+            int quantity;
+            cout << "Enter quantity: ";
+            cin >> quantity;
+
+            double itemTotal = 0.0;
+            SalesEvent line;
+            bool taken = holdLines ? reserveProduct(choice - 1, quantity, line)
+                                   : purchaseProduct(choice - 1, quantity, itemTotal);
+            if (taken) {
+                if (holdLines) {
+                    itemTotal = line.amount;
+                    reserved.push_back(line);
+                }
+                total += itemTotal;
+                purchaseMade = true;
+                basket.push_back(BasketLine{static_cast<size_t>(choice - 1), quantity, itemTotal / quantity});
+                report(ReceiptEvent{RECEIPT_SUBTOTAL, nullptr, nullptr, quantity, 0, itemTotal});
+            }
+
+            flushReceipts();
+            cout << "Select another product? (y/n): ";
+            cin >> continueChoice;
+        } while (continueChoice == 'y' || continueChoice == 'Y');
+
+        vector<int> appliedRules(basket.size(), -1);
+        double discount = applyPromotions(basket, appliedRules.data());
+        if (discount > 0) {
+            for (size_t i = 0; i < basket.size(); ++i) {
+                if (appliedRules[i] >= 0) {
+                    report(ReceiptEvent{RECEIPT_PROMOTION, &products[basket[i].product]->getName(),
+                                        &promotions->ruleName(appliedRules[i]), basket[i].quantity, 0, 0.0});
+                }
+            }
+            report(ReceiptEvent{RECEIPT_PROMOTION_SAVINGS, nullptr, nullptr, 0, 0, discount});
+            total -= discount;
+        }
+
+        if (purchaseMade && holdLines) {
+            flushReceipts();
+            bool approved;
+            if (cashBox != nullptr) {
+                approved = collectCash(total);
+            } else {
+                cout << "Authorizing payment of $" << fixed << setprecision(2) << total << "..." << endl;
+                PaymentWaiter waiter;
+                payments->authorize(PaymentRequest{1, total, 0}, waiter);
+                approved = waiter.wait() == PAYMENT_APPROVED;
+                if (!approved) {
+                    cout << "Payment declined." << endl;
+                }
+            }
+            settleBasket(reserved, approved, total, countDistinctProducts(basket), 0);
+            if (!approved) {
+                cout << "Items returned to stock." << endl;
+                total = 0.0;
+            }
+        } else if (purchaseMade) {
+            completeBasket(total, countItems(basket), countDistinctProducts(basket));
+        }
+        flushReceipts();
+
+        return total;
+    }
+
+    ~VendingMachine() {
+        for (auto product : products) {
+            delete product;
+        }
+    }
+};
+
+// Builds the standard Smart Vending planogram used by the interactive mode
+void addDefaultCatalog(VendingMachine& machine) {
+    // Adding regular products
+    machine.addProduct(new DiscountedProduct("Lays Chips", 2.50, 10, 15));        // 15% off
+    machine.addProduct(new Beverage("Coca Cola", 2.00, 12, true, 0.33));          // carbonated, 330ml
+    machine.addProduct(new DiscountedProduct("Protein Bar", 3.50, 8, 10));        // 10% off
+    machine.addProduct(new Beverage("Mineral Water", 1.50, 15, false, 0.5));      // non-carbonated, 500ml
+    machine.addProduct(new Beverage("Monster Energy", 3.50, 10, true, 0.473));    // carbonated, 473ml
+
+    // Adding a new type of product (Limited Time Offer)
+    machine.addProduct(new LimitedTimeProduct("Special Snack", 5.00, 5, 3.99, 7)); // 7-day offer
+}
+
+// Payment stage class - pipelines payment authorization for many concurrent baskets.
+// submit() reserves nothing itself: callers reserve the basket lines, hand them over and
+// move on to the next customer while the gateway works. When the answer arrives the stage
+// commits the lines (approved) or puts them back on sale (declined), so stock is held only
+// while an authorization is in flight and throughput no longer waits on the round trip.
+// At most maxInFlight baskets are outstanding; submit() blocks beyond that.
+class PaymentStage : public PaymentListener {
+private:
+    struct Basket {
+        vector<SalesEvent> lines;
+        double total;
+        int distinctProducts;
+        unsigned long long customer;
+        chrono::steady_clock::time_point submitted;
+        unsigned generation;  // tells a recycled slot from the ticket it used to hold
+    };
+
+    VendingMachine& machine;
+    PaymentGateway& gateway;
+    mutex stageMutex;
+    condition_variable slotFreed;
+    vector<Basket> baskets;
+    vector<size_t> freeSlots;
+    long approved;
+    long declined;
+    double approvedRevenue;
+    size_t peakInFlight;
+    vector<double> authorizationMicros;
+
+public:
+    PaymentStage(VendingMachine& machine, PaymentGateway& gateway, size_t maxInFlight = 4096)
+        : machine(machine), gateway(gateway), baskets(max<size_t>(maxInFlight, 1)),
+          approved(0), declined(0), approvedRevenue(0.0), peakInFlight(0) {
+        for (size_t i = baskets.size(); i-- > 0;) {
+            baskets[i].generation = 0;
+            freeSlots.push_back(i);
+        }
+    }
+
+    // Sends a basket of lines reserved with VendingMachine::reserveProduct for authorization
+    void submit(const vector<SalesEvent>& lines, double total, int distinctProducts, unsigned long long customer) {
+        if (lines.empty()) return;  // Added validation
+
+        size_t slot;
+        unsigned long long ticket;
+        {
+            unique_lock<mutex> lock(stageMutex);
+            slotFreed.wait(lock, [this]() { return !freeSlots.empty(); });
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            peakInFlight = max(peakInFlight, baskets.size() - freeSlots.size());
+
+            Basket& basket = baskets[slot];
+            basket.lines.assign(lines.begin(), lines.end());  // slots keep their capacity between baskets
+            basket.total = total;
+            basket.distinctProducts = distinctProducts;
+            basket.customer = customer;
+            basket.submitted = chrono::steady_clock::now();
+            ticket = (static_cast<unsigned long long>(basket.generation) << 32) | slot;
+        }
+        gateway.authorize(PaymentRequest{ticket, total, customer}, *this);
+    }
+
+    void onPaymentResult(unsigned long long ticket, PaymentStatus status) override {
+        size_t slot = static_cast<size_t>(ticket & 0xffffffffULL);
+        unique_lock<mutex> lock(stageMutex);
+        if (slot >= baskets.size() || baskets[slot].generation != (ticket >> 32)) return;  // unknown ticket
+
+        // Settle outside the lock; the slot stays claimed until then
+        Basket& basket = baskets[slot];
+        lock.unlock();
+        bool accepted = status == PAYMENT_APPROVED;
+        machine.settleBasket(basket.lines, accepted, basket.total, basket.distinctProducts, basket.customer);
+        chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - basket.submitted;
+        lock.lock();
+
+        basket.generation++;
+        freeSlots.push_back(slot);
+        (accepted ? approved : declined)++;
+        if (accepted) {
+            approvedRevenue += basket.total;
+        }
+        authorizationMicros.push_back(elapsed.count());
+        slotFreed.notify_all();
+    }
+
+    // Waits until every submitted basket has been settled
+    void drain() {
+        unique_lock<mutex> lock(stageMutex);
+        slotFreed.wait(lock, [this]() { return freeSlots.size() == baskets.size(); });
+    }
+
+    long getApprovedCount() {
+        lock_guard<mutex> lock(stageMutex);
+        return approved;
+    }
+
+    long getDeclinedCount() {
+        lock_guard<mutex> lock(stageMutex);
+        return declined;
+    }
+
+    double getApprovedRevenue() {
+        lock_guard<mutex> lock(stageMutex);
+        return approvedRevenue;
+    }
+
+    void displayStats() {
+        lock_guard<mutex> lock(stageMutex);
+        vector<double> sorted(authorizationMicros);
+        sort(sorted.begin(), sorted.end());
+        auto percentile = [&sorted](double p) {
+            return sorted.empty() ? 0.0 : sorted[min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+        };
+        cout << "Payments: " << approved << " approved, " << declined << " declined, peak "
+             << peakInFlight << " in flight" << endl;
+        cout << fixed << setprecision(2) << "Authorization round trip (ms): p50 " << percentile(0.5) / 1000
+             << ", p99 " << percentile(0.99) / 1000 << endl;
+    }
+};
+
+// Replication message kinds; the first byte of every message
+enum ReplicationMessageType : unsigned char {
+    REPLICATION_DELTA = 1,     // changed slots since the previous sequence number
+    REPLICATION_SNAPSHOT = 2,  // every slot, replacing the replica's state
+    REPLICATION_RESYNC = 3,    // replica -> machine: a delta was missed, send a snapshot
+    REPLICATION_HEARTBEAT = 4  // nothing changed; carries the sequence of the last delta sent
+};
+
+// Replication transport interface - one direction of a link between a machine and a replica
+class ReplicationTransport {
+public:
+    virtual ~ReplicationTransport() {}
+    virtual void send(const vector<unsigned char>& message) = 0;
+    // Next pending message; false when nothing is waiting
+    virtual bool receive(vector<unsigned char>& message) = 0;
+};
+
+// In-process transport for tests and the load generator. lossRate drops that fraction of
+// messages at random, to exercise replica resynchronization.
+class LoopbackTransport : public ReplicationTransport {
+private:
+    mutex queueMutex;
+    deque<vector<unsigned char>> pending;
+    double lossRate;
+    mt19937_64 rng;
+    long messagesSent;
+    long messagesDropped;
+    long long bytesSent;
+    long forcedDrops;  // the next messages to drop whatever lossRate says
+
+public:
+    LoopbackTransport(double lossRate = 0.0, unsigned long long seed = 1)
+        : lossRate(lossRate), rng(seed), messagesSent(0), messagesDropped(0), bytesSent(0), forcedDrops(0) {}
+
+    // Drops the next count messages, for loss tests
+    void dropNext(long count) {
+        lock_guard<mutex> lock(queueMutex);
+        forcedDrops = count;
+    }
+
+    void send(const vector<unsigned char>& message) override {
+        lock_guard<mutex> lock(queueMutex);
+        messagesSent++;
+        bytesSent += message.size();
+        if (forcedDrops > 0 || (lossRate > 0 && uniform_real_distribution<double>(0.0, 1.0)(rng) < lossRate)) {
+            if (forcedDrops > 0) forcedDrops--;
+            messagesDropped++;
+            return;
+        }
+        pending.push_back(message);
+    }
+
+    bool receive(vector<unsigned char>& message) override {
+        lock_guard<mutex> lock(queueMutex);
+        if (pending.empty()) return false;
+        message.swap(pending.front());
+        pending.pop_front();
+        return true;
+    }
+
+    void displayStats(const string& label) {
+        lock_guard<mutex> lock(queueMutex);
+        cout << label << ": " << messagesSent << " messages, " << bytesSent << " bytes, "
+             << messagesDropped << " dropped" << endl;
+    }
+};
+
+// Inventory replicator class - ships a machine's stock and base price changes to replicas.
+// Each delta batch lists only the slots marked in the replication log since the previous
+// batch: slot numbers as gaps from the previous slot, stock and price (in cents) as
+// differences from the last shipped value, all varint-encoded. A batch therefore costs a
+// few bytes per changed slot, whatever the catalog size. Replicas that miss a batch ask
+// for a snapshot over their feedback link.
+class InventoryReplicator {
+private:
+    struct Link {
+        ReplicationTransport* outgoing;
+        ReplicationTransport* feedback;  // may be null: the replica cannot ask for resyncs
+    };
+
+    VendingMachine& machine;
+    ReplicationLog log;
+    vector<Link> links;
+    unsigned long long sequence;
+    vector<int> shippedStock;  // what every in-sync replica holds
+    vector<long long> shippedCents;
+    vector<size_t> slots;
+    vector<int> stock;
+    vector<double> basePrice;
+    vector<unsigned char> message;
+    long deltas;
+    long snapshots;
+    long long entries;
+
+    void beginMessage(ReplicationMessageType type, size_t count) {
+        message.clear();
+        message.push_back(type);
+        ReplicationCodec::putVarint(message, sequence);
+        ReplicationCodec::putVarint(message, shippedStock.size());
+        ReplicationCodec::putVarint(message, count);
+    }
+
+    // Entry: (slot gap << 1 | price changed), stock delta, [price delta in cents]
+    void putEntry(size_t& previousSlot, size_t slot, long long stockDelta, long long centsDelta) {
+        ReplicationCodec::putVarint(message, ((slot - previousSlot) << 1) | (centsDelta != 0 ? 1 : 0));
+        ReplicationCodec::putSigned(message, stockDelta);
+        if (centsDelta != 0) {
+            ReplicationCodec::putSigned(message, centsDelta);
+        }
+        previousSlot = slot;
+    }
+
+    void buildSnapshot() {
+        beginMessage(REPLICATION_SNAPSHOT, shippedStock.size());
+        size_t previousSlot = 0;
+        for (size_t i = 0; i < shippedStock.size(); ++i) {
+            putEntry(previousSlot, i, shippedStock[i], shippedCents[i]);
+        }
+    }
+
+public:
+    // Attaches its own replication log to machine; keep the replicator alive while the machine runs
+    InventoryReplicator(VendingMachine& machine)
+        : machine(machine), sequence(0), deltas(0), snapshots(0), entries(0) {
+        machine.attachReplicationLog(&log);
+    }
+
+    ~InventoryReplicator() {
+        machine.attachReplicationLog(nullptr);
+    }
+
+    // Links must outlive the replicator. New replicas start from a snapshot.
+    void addReplica(ReplicationTransport* outgoing, ReplicationTransport* feedback) {
+        ship();  // brings the shipped state up to date for the existing replicas first
+        links.push_back(Link{outgoing, feedback});
+        buildSnapshot();
+        outgoing->send(message);
+        snapshots++;
+    }
+
+    // Call from one thread at a time. Sends one delta batch to every replica, then a snapshot
+    // to any replica that asked for one. With nothing changed it sends a heartbeat instead,
+    // carrying the sequence number of the last delta, so a replica that lost that delta
+    // notices the gap and asks for a snapshot.
+    void ship() {
+        log.take(slots);
+        machine.readReplicatedState(slots, stock, basePrice);
+        if (shippedStock.size() < log.getProductCount()) {
+            shippedStock.resize(log.getProductCount(), 0);
+            shippedCents.resize(log.getProductCount(), 0);
+        }
+
+        size_t count = 0;
+        for (size_t i = 0; i < slots.size(); ++i) {
+            if (stock[i] != shippedStock[slots[i]] || ReplicationCodec::toCents(basePrice[i]) != shippedCents[slots[i]]) {
+                slots[count] = slots[i];
+                stock[count] = stock[i];
+                basePrice[count] = basePrice[i];
+                count++;
+            }
+        }
+        if (count > 0) {
+            sequence++;
+        }
+        beginMessage(count > 0 ? REPLICATION_DELTA : REPLICATION_HEARTBEAT, count);
+        size_t previousSlot = 0;
+        for (size_t i = 0; i < count; ++i) {
+            long long cents = ReplicationCodec::toCents(basePrice[i]);
+            putEntry(previousSlot, slots[i], static_cast<long long>(stock[i]) - shippedStock[slots[i]],
+                     cents - shippedCents[slots[i]]);
+            shippedStock[slots[i]] = stock[i];
+            shippedCents[slots[i]] = cents;
+        }
+        for (const Link& link : links) {
+            link.outgoing->send(message);
+        }
+        if (!links.empty()) {  // the first ship() only primes the shipped state
+            deltas++;
+            entries += count;
+        }
+
+        bool snapshotBuilt = false;
+        vector<unsigned char> request;
+        for (const Link& link : links) {
+            bool resync = false;
+            while (link.feedback != nullptr && link.feedback->receive(request)) {
+                resync = resync || (!request.empty() && request[0] == REPLICATION_RESYNC);
+            }
+            if (resync) {
+                if (!snapshotBuilt) {
+                    buildSnapshot();
+                    snapshotBuilt = true;
+                }
+                link.outgoing->send(message);
+                snapshots++;
+            }
+        }
+    }
+
+    unsigned long long getSequence() const { return sequence; }
+
+    void displayStats() const {
+        cout << "Replication: " << deltas << " delta batches (" << entries << " changed slots), "
+             << snapshots << " snapshots, sequence " << sequence << endl;
+    }
+};
+
+// Inventory replica class - the aggregator's copy of one machine's stock and base prices.
+// Applies delta batches in sequence order; on a gap it discards deltas and asks for a
+// snapshot until one arrives.
+class InventoryReplica {
+private:
+    ReplicationTransport& incoming;
+    ReplicationTransport* feedback;
+    vector<int> stock;
+    vector<long long> cents;
+    unsigned long long sequence;
+    bool synced;  // false until the first snapshot, and after a gap
+    vector<unsigned char> message;
+    long rejected;
+
+    // Parses and applies one message; false if it was malformed
+    bool apply(const vector<unsigned char>& data) {
+        const unsigned char* position = data.data();
+        const unsigned char* end = position + data.size();
+        if (position == end) return false;
+        unsigned char type = *position++;
+        unsigned long long messageSequence, productCount, count;
+        if (!ReplicationCodec::getVarint(position, end, messageSequence) ||
+            !ReplicationCodec::getVarint(position, end, productCount) ||
+            !ReplicationCodec::getVarint(position, end, count)) return false;
+
+        if (type == REPLICATION_DELTA || type == REPLICATION_HEARTBEAT) {
+            if (synced && messageSequence <= sequence) {
+                return true;  // heartbeat while caught up, or stale batch
+            }
+            // A heartbeat ahead of the replica, or a delta that skips one, means a delta was lost
+            if (!synced || type == REPLICATION_HEARTBEAT || messageSequence != sequence + 1) {
+                // Asks again on every batch until the snapshot lands, in case a request was lost;
+                // the replicator answers at most one snapshot per ship() either way
+                synced = false;
+                if (feedback != nullptr) {
+                    feedback->send(vector<unsigned char>(1, REPLICATION_RESYNC));
+                }
+                return true;
+            }
+        } else if (type != REPLICATION_SNAPSHOT) {
+            return false;
+        }
+
+        vector<int> nextStock;
+        vector<long long> nextCents;
+        if (type == REPLICATION_SNAPSHOT) {
+            nextStock.assign(productCount, 0);
+            nextCents.assign(productCount, 0);
+        } else {
+            nextStock = stock;
+            nextCents = cents;
+            nextStock.resize(max<size_t>(productCount, stock.size()), 0);
+            nextCents.resize(nextStock.size(), 0);
+        }
+        size_t slot = 0;
+        for (unsigned long long i = 0; i < count; ++i) {
+            unsigned long long header;
+            long long stockDelta, centsDelta = 0;
+            if (!ReplicationCodec::getVarint(position, end, header) ||
+                !ReplicationCodec::getSigned(position, end, stockDelta)) return false;
+            if ((header & 1) != 0 && !ReplicationCodec::getSigned(position, end, centsDelta)) return false;
+            slot += header >> 1;
+            if (slot >= nextStock.size()) return false;
+            nextStock[slot] += static_cast<int>(stockDelta);
+            nextCents[slot] += centsDelta;
+        }
+        stock.swap(nextStock);
+        cents.swap(nextCents);
+        sequence = messageSequence;
+        synced = true;
+        return true;
+    }
+
+public:
+    // feedback carries resync requests back to the machine; may be null
+    InventoryReplica(ReplicationTransport& incoming, ReplicationTransport* feedback)
+        : incoming(incoming), feedback(feedback), sequence(0), synced(false), rejected(0) {}
+
+    // Applies every pending message; returns how many were received
+    size_t poll() {
+        size_t received = 0;
+        while (incoming.receive(message)) {
+            if (!apply(message)) rejected++;
+            received++;
+        }
+        return received;
+    }
+
+    bool isSynced() const { return synced; }
+    unsigned long long getSequence() const { return sequence; }
+    size_t getProductCount() const { return stock.size(); }
+    int getStock(size_t index) const { return index < stock.size() ? stock[index] : 0; }
+    double getBasePrice(size_t index) const { return index < cents.size() ? cents[index] / 100.0 : 0.0; }
+    long getRejectedMessages() const { return rejected; }
+};
+
+// Catalog loader class - streams CSV or JSON catalog files straight into a VendingMachine.
+// Both formats are parsed in a single pass over a fixed read buffer; no document tree is built.
+//
+// CSV:  kind,name,price,stock[,extra1[,extra2]]
+//       general                      -
+//       discounted                   discount
+//       beverage                     carbonated (1/0/true/false), volume
+//       limited                      specialPrice, daysValid
+// JSON: [{"kind": "beverage", "name": "Coca Cola", "price": 2.0, "stock": 12,
+//         "carbonated": true, "volume": 0.33}, ...]
+//       other keys: "discount", "specialPrice", "daysValid"
+class CatalogLoader {
+public:
+    struct Result {
+        size_t loaded;
+        size_t skipped;
+        string firstError;
+    };
+
+private:
+    struct ProductFields {
+        string kind;
+        string name;
+        double basePrice;
+        int stock;
+        double discount;
+        bool carbonated;
+        double volume;
+        double specialPrice;
+        int daysValid;
+
+        // Clears values but keeps string capacity, so rows after the first do not allocate here
+        void reset() {
+            kind.clear();
+            name.clear();
+            basePrice = 0.0;
+            stock = 0;
+            discount = 0.0;
+            carbonated = false;
+            volume = 0.0;
+            specialPrice = -1.0;
+            daysValid = 0;
+        }
+    };
+
+    // Refills a fixed-size buffer from the stream; get/peek are the only per-character calls
+    class InputBuffer {
+    private:
+        istream& in;
+        vector<char> data;
+        size_t position;
+        size_t length;
+
+        bool refill() {
+            if (!in) return false;
+            in.read(data.data(), data.size());
+            length = static_cast<size_t>(in.gcount());
+            position = 0;
+            return length > 0;
+        }
+
+    public:
+        explicit InputBuffer(istream& in) : in(in), data(1 << 20), position(0), length(0) {}
+
+        int peek() {
+            if (position == length && !refill()) return EOF;
+            return static_cast<unsigned char>(data[position]);
+        }
+
+        int get() {
+            int c = peek();
+            if (c != EOF) position++;
+            return c;
+        }
+    };
+
+    static Product* createProduct(const ProductFields& fields) {
+        if (fields.name.empty() || fields.basePrice < 0 || fields.stock < 0) return nullptr;  // Added validation
+
+        if (fields.kind == "discounted") {
+            return new DiscountedProduct(fields.name, fields.basePrice, fields.stock, fields.discount);
+        } else if (fields.kind == "beverage") {
+            return new Beverage(fields.name, fields.basePrice, fields.stock, fields.carbonated, fields.volume);
+        } else if (fields.kind == "limited") {
+            return new LimitedTimeProduct(fields.name, fields.basePrice, fields.stock,
+                                          fields.specialPrice, fields.daysValid);
+        } else if (fields.kind == "general" || fields.kind.empty()) {
+            return new Product(fields.name, fields.basePrice, fields.stock);
+        }
+        return nullptr;
+    }
+
+    static bool parseBool(const string& value) {
+        return value == "1" || value == "true" || value == "TRUE" || value == "yes";
+    }
+
+    static void addOrSkip(const ProductFields& fields, size_t row, VendingMachine& machine, Result& result) {
+        Product* product = createProduct(fields);
+        if (product != nullptr) {
+            machine.addProduct(product);
+            result.loaded++;
+            return;
+        }
+        if (result.skipped++ == 0) {
+            result.firstError = "row " + to_string(row) + ": invalid product \"" + fields.name + "\"";
+        }
+    }
+
+    // Reads one CSV field (RFC 4180 quoting); returns the character that ended it
+    static int readCsvField(InputBuffer& input, string& field) {
+        field.clear();
+        int c = input.get();
+        if (c == '"') {
+            while ((c = input.get()) != EOF) {
+                if (c == '"') {
+                    if (input.peek() != '"') {
+                        c = input.get();
+                        break;
+                    }
+                    input.get();
+                }
+                field.push_back(static_cast<char>(c));
+            }
+        }
+        while (c != EOF && c != ',' && c != '\n') {
+            if (c != '\r') field.push_back(static_cast<char>(c));
+            c = input.get();
+        }
+        return c;
+    }
+
+    static void skipJsonWhitespace(InputBuffer& input) {
+        int c = input.peek();
+        while (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+            input.get();
+            c = input.peek();
+        }
+    }
+
+    static bool readJsonString(InputBuffer& input, string& value) {
+        value.clear();
+        if (input.get() != '"') return false;
+        int c;
+        while ((c = input.get()) != EOF && c != '"') {
+            if (c == '\\') {
+                c = input.get();
+                switch (c) {
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case 'u':  // non-ASCII escapes are kept as '?'; catalog names are plain text
+                        for (int i = 0; i < 4; ++i) input.get();
+                        c = '?';
+                        break;
+                    default: break;
+                }
+            }
+            value.push_back(static_cast<char>(c));
+        }
+        return c == '"';
+    }
+
+    // Reads a scalar (number or literal) as text; nested arrays/objects are skipped entirely
+    static bool readJsonValue(InputBuffer& input, string& value) {
+        skipJsonWhitespace(input);
+        int c = input.peek();
+        if (c == '"') return readJsonString(input, value);
+
+        value.clear();
+        if (c == '{' || c == '[') {
+            int depth = 0;
+            bool inString = false;
+            while ((c = input.get()) != EOF) {
+                if (inString) {
+                    if (c == '\\') input.get();
+                    else if (c == '"') inString = false;
+                } else if (c == '"') {
+                    inString = true;
+                } else if (c == '{' || c == '[') {
+                    depth++;
+                } else if ((c == '}' || c == ']') && --depth == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        while ((c = input.peek()) != EOF && c != ',' && c != '}' && c != ']' &&
+               c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+            value.push_back(static_cast<char>(input.get()));
+        }
+        return !value.empty();
+    }
+
+    static void assignJsonField(ProductFields& fields, const string& key, const string& value) {
+        if (key == "kind") fields.kind = value;
+        else if (key == "name") fields.name = value;
+        else if (key == "price" || key == "basePrice") fields.basePrice = atof(value.c_str());
+        else if (key == "stock" || key == "stockQuantity") fields.stock = atoi(value.c_str());
+        else if (key == "discount") fields.discount = atof(value.c_str());
+        else if (key == "carbonated" || key == "isCarbonated") fields.carbonated = parseBool(value);
+        else if (key == "volume") fields.volume = atof(value.c_str());
+        else if (key == "specialPrice") fields.specialPrice = atof(value.c_str());
+        else if (key == "daysValid") fields.daysValid = atoi(value.c_str());
+    }
+
+public:
+    static Result loadCsv(istream& in, VendingMachine& machine) {
+        Result result = Result();
+        InputBuffer input(in);
+        ProductFields fields;
+        string columns[6];
+        size_t row = 0;
+
+        while (input.peek() != EOF) {
+            row++;
+            int count = 0;
+            int end = ',';
+            while (end == ',') {
+                string scratch;
+                end = readCsvField(input, count < 6 ? columns[count] : scratch);
+                count++;
+            }
+
+            if (count == 1 && columns[0].empty()) continue;                  // blank line
+            if (columns[0].compare(0, 1, "#") == 0 || columns[0] == "kind") continue;  // comment / header
+
+            fields.reset();
+            fields.kind = columns[0];
+            if (count > 1) fields.name = columns[1];
+            if (count > 2) fields.basePrice = atof(columns[2].c_str());
+            if (count > 3) fields.stock = atoi(columns[3].c_str());
+            if (fields.kind == "discounted" && count > 4) {
+                fields.discount = atof(columns[4].c_str());
+            } else if (fields.kind == "beverage") {
+                if (count > 4) fields.carbonated = parseBool(columns[4]);
+                if (count > 5) fields.volume = atof(columns[5].c_str());
+            } else if (fields.kind == "limited") {
+                if (count > 4) fields.specialPrice = atof(columns[4].c_str());
+                if (count > 5) fields.daysValid = atoi(columns[5].c_str());
+            }
+            addOrSkip(fields, row, machine, result);
+        }
+        return result;
+    }
+
+    static Result loadJson(istream& in, VendingMachine& machine) {
+        Result result = Result();
+        InputBuffer input(in);
+        ProductFields fields;
+        string key, value;
+        size_t row = 0;
+
+        skipJsonWhitespace(input);
+        if (input.get() != '[') {
+            result.firstError = "expected a JSON array of products";
+            return result;
+        }
+
+        while (true) {
+            skipJsonWhitespace(input);
+            int c = input.get();
+            if (c == ']' || c == EOF) break;
+            if (c == ',') continue;
+            if (c != '{') {
+                result.firstError = "unexpected character in product list";
+                break;
+            }
+
+            row++;
+            fields.reset();
+            while (true) {
+                skipJsonWhitespace(input);
+                c = input.peek();
+                if (c == '}') {
+                    input.get();
+                    break;
+                }
+                if (c == ',') {
+                    input.get();
+                    continue;
+                }
+                if (!readJsonString(input, key)) {
+                    result.firstError = "row " + to_string(row) + ": malformed key";
+                    return result;
+                }
+                skipJsonWhitespace(input);
+                if (input.get() != ':' || !readJsonValue(input, value)) {
+                    result.firstError = "row " + to_string(row) + ": malformed value for \"" + key + "\"";
+                    return result;
+                }
+                assignJsonField(fields, key, value);
+            }
+            addOrSkip(fields, row, machine, result);
+        }
+        return result;
+    }
+
+    // Price files hold "product number,base price" rows (numbers as shown by displayProducts).
+    // The whole file is published as one repricing.
+    static bool loadPriceFile(const string& path, VendingMachine& machine) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            cout << "Could not open price file: " << path << endl;
+            return false;
+        }
+
+        InputBuffer input(file);
+        vector<pair<size_t, double>> changes;
+        string number, price;
+        while (input.peek() != EOF) {
+            int end = readCsvField(input, number);
+            if (end != ',') continue;  // blank, header-less or malformed row
+            end = readCsvField(input, price);
+            while (end != '\n' && end != EOF) {
+                string ignored;
+                end = readCsvField(input, ignored);
+            }
+
+            long productNumber = atol(number.c_str());
+            if (productNumber >= 1 && static_cast<size_t>(productNumber) <= machine.getProductCount()) {
+                changes.push_back(make_pair(static_cast<size_t>(productNumber - 1), atof(price.c_str())));
+            }
+        }
+        machine.repriceProducts(changes);
+        cout << "Repriced " << changes.size() << " products from " << path << endl;
+        return true;
+    }
+
+    // Loads path into machine (format chosen by extension) and prints a one-line summary
+    static bool loadFile(const string& path, VendingMachine& machine) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            cout << "Could not open catalog file: " << path << endl;
+            return false;
+        }
+
+        // Reserve from the file size; rows are rarely shorter than ~24 bytes
+        file.seekg(0, ios::end);
+        streamoff bytes = file.tellg();
+        file.seekg(0, ios::beg);
+        machine.reserveProducts(machine.getProductCount() + static_cast<size_t>(bytes > 0 ? bytes / 24 : 0));
+
+        bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        Result result = json ? loadJson(file, machine) : loadCsv(file, machine);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        cout << "Loaded " << result.loaded << " products from " << path
+             << " in " << fixed << setprecision(2) << seconds << " s";
+        if (result.skipped > 0) {
+            cout << " (" << result.skipped << " skipped)";
+        }
+        cout << endl;
+        if (!result.firstError.empty()) {
+            cout << "First error: " << result.firstError << endl;
+        }
+        return result.loaded > 0;
+    }
+};
+
+// Command line helper class - reads --key=value style options
+class CommandLineOptions {
+public:
+    static bool has(int argc, char* argv[], const string& key) {
+        string flag = "--" + key;
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == flag || arg.compare(0, flag.size() + 1, flag + "=") == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static string get(int argc, char* argv[], const string& key, const string& fallback) {
+        string prefix = "--" + key + "=";
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg.compare(0, prefix.size(), prefix) == 0) {
+                return arg.substr(prefix.size());
+            }
+        }
+        return fallback;
+    }
+
+    static double getDouble(int argc, char* argv[], const string& key, double fallback) {
+        string value = get(argc, argv, key, "");
+        return value.empty() ? fallback : atof(value.c_str());
+    }
+
+    static long getInt(int argc, char* argv[], const string& key, long fallback) {
+        string value = get(argc, argv, key, "");
+        return value.empty() ? fallback : atol(value.c_str());
+    }
+};
+
+// Zipf distribution class - samples product ranks where rank k has weight 1/(k+1)^s
+class ZipfDistribution {
+private:
+    vector<double> cumulative;
+
+public:
+    ZipfDistribution(size_t count, double exponent) : cumulative(count > 0 ? count : 1) {
+        double sum = 0.0;
+        for (size_t k = 0; k < cumulative.size(); ++k) {
+            sum += 1.0 / pow(static_cast<double>(k + 1), exponent);
+            cumulative[k] = sum;
+        }
+        for (size_t k = 0; k < cumulative.size(); ++k) {
+            cumulative[k] /= sum;
+        }
+    }
+
+    // O(log n) inverse-CDF lookup
+    size_t sample(mt19937_64& rng) const {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        size_t rank = upper_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin();
+        return rank < cumulative.size() ? rank : cumulative.size() - 1;
+    }
+};
+
+struct LoadGeneratorConfig {
+    size_t catalogSize;      // 0 = the default Smart Vending catalog
+    double zipfExponent;
+    int minBasketSize;
+    int maxBasketSize;
+    int maxQuantity;         // per basket line
+    double restockRatio;     // fraction of operations that are restocks
+    double reportRatio;      // fraction of operations that are operator catalog reports
+    int restockQuantity;
+    double arrivalRate;      // operations per second across all threads, 0 = closed loop
+    int threads;
+    double durationSeconds;
+    unsigned long seed;
+    unsigned long long customers;  // size of the simulated customer base
+    double retryRatio;       // fraction of basket lines sent twice with the same request id
+};
+
+struct LoadGeneratorReport {
+    long baskets;  // paid baskets only
+    long declined;  // baskets whose payment was refused; their lines went back on sale
+    long emptyBaskets;  // baskets whose every line was rejected; not counted as operations
+    long restocks;
+    long reports;
+    long shed;  // requests refused by admission control
+    long linesPurchased;
+    long linesRejected;
+    double revenue;
+    double discounts;
+    long retries;
+    long retryMismatches;  // retries whose answer differed from the original
+    double elapsedSeconds;
+    vector<double> latenciesMicros;  // sorted
+    vector<double> basketLatenciesMicros;  // sorted
+};
+
+// Load generator class - drives VendingMachine purchases and restocks with Zipf popularity
+class LoadGenerator {
+private:
+    VendingMachine& machine;
+    LoadGeneratorConfig config;
+    ZipfDistribution popularity;
+    vector<size_t> rankToProduct;  // shuffled so popularity is not tied to catalog order
+    PaymentStage* payments;        // baskets are paid asynchronously when set
+    ChangeMaker* cashBox;          // baskets are paid in cash when set
+    vector<int> coinLevels;        // hopper levels restored on every restock visit
+    AdmissionController* admission;  // gates every request when set
+
+    struct WorkerResult {
+        long baskets = 0;
+        long declined = 0;
+        long emptyBaskets = 0;
+        long restocks = 0;
+        long reports = 0;
+        long shed = 0;
+        long linesPurchased = 0;
+        long linesRejected = 0;
+        double revenue = 0.0;
+        double discounts = 0.0;
+        long retries = 0;
+        long retryMismatches = 0;
+        vector<double> latenciesMicros;
+        vector<double> basketLatenciesMicros;
+    };
+
+    void runWorker(int workerIndex, chrono::steady_clock::time_point start,
+                   chrono::steady_clock::time_point stop, WorkerResult& result) {
+        mt19937_64 rng(config.seed + 7919 * (workerIndex + 1));
+        uniform_real_distribution<double> unit(0.0, 1.0);
+        uniform_int_distribution<int> basketSize(config.minBasketSize, config.maxBasketSize);
+        uniform_int_distribution<int> quantity(1, config.maxQuantity);
+        uniform_int_distribution<unsigned long long> customer(1, config.customers);
+
+        // Open loop: each worker gets an equal share of the arrival rate with exponential gaps.
+        // Latency is measured from the scheduled arrival, so queueing delay is not hidden.
+        bool openLoop = config.arrivalRate > 0;
+        exponential_distribution<double> gap(openLoop ? config.arrivalRate / config.threads : 1.0);
+        chrono::steady_clock::time_point nextArrival = start;
+        vector<BasketLine> basket;
+        basket.reserve(config.maxBasketSize);
+        vector<SalesEvent> reserved;
+        reserved.reserve(config.maxBasketSize);
+        vector<int> change;
+        bool holdLines = payments != nullptr || cashBox != nullptr;
+        unsigned long long requestCount = 0;
+        vector<size_t> allSlots;
+        vector<int> reportStock;
+        vector<double> reportPrices;
+        if (config.reportRatio > 0) {
+            for (size_t i = 0; i < machine.getProductCount(); ++i) {
+                allSlots.push_back(i);
+            }
+        }
+
+        while (true) {
+            if (openLoop) {
+                nextArrival += chrono::duration_cast<chrono::steady_clock::duration>(
+                    chrono::duration<double>(gap(rng)));
+                if (nextArrival >= stop) break;
+                this_thread::sleep_until(nextArrival);
+            }
+            chrono::steady_clock::time_point issued = openLoop ? nextArrival : chrono::steady_clock::now();
+            if (!openLoop && issued >= stop) break;
+
+            double roll = unit(rng);
+            RequestPriority priority = roll < config.restockRatio ? PRIORITY_RESTOCK
+                                     : roll < config.restockRatio + config.reportRatio ? PRIORITY_REPORT
+                                     : PRIORITY_PURCHASE;
+            chrono::steady_clock::time_point admittedAt;
+            if (admission != nullptr) {
+                if (!admission->admit(priority, issued)) {
+                    result.shed++;
+                    continue;
+                }
+                admittedAt = chrono::steady_clock::now();
+            }
+
+            if (priority == PRIORITY_RESTOCK) {
+                machine.restockProduct(rankToProduct[popularity.sample(rng)], config.restockQuantity);
+                if (cashBox != nullptr) {
+                    cashBox->topUp(coinLevels);
+                }
+                result.restocks++;
+            } else if (priority == PRIORITY_REPORT) {
+                // Reads what displayProducts shows for every slot, without printing it
+                machine.readReplicatedState(allSlots, reportStock, reportPrices);
+                result.reports++;
+            } else {
+                double total = 0.0;
+                int lines = basketSize(rng);
+                basket.clear();
+                reserved.clear();
+                for (int i = 0; i < lines; ++i) {
+                    double itemTotal = 0.0;
+                    size_t product = rankToProduct[popularity.sample(rng)];
+                    int units = quantity(rng);
+                    SalesEvent line;
+                    unsigned long long requestId = (static_cast<unsigned long long>(workerIndex) + 1) << 40 | ++requestCount;
+                    bool taken = holdLines ? machine.reserveProduct(product, units, line)
+                                           : machine.purchaseProduct(product, units, itemTotal, requestId);
+                    if (!holdLines && config.retryRatio > 0 && unit(rng) < config.retryRatio) {
+                        // The kiosk lost the answer and sends the same request again
+                        double retryTotal = 0.0;
+                        bool retried = machine.purchaseProduct(product, units, retryTotal, requestId);
+                        result.retries++;
+                        if (retried != taken || (taken && retryTotal != itemTotal)) {
+                            result.retryMismatches++;
+                        }
+                    }
+                    if (taken) {
+                        if (holdLines) {
+                            itemTotal = line.amount;
+                            reserved.push_back(line);
+                        }
+                        total += itemTotal;
+                        basket.push_back(BasketLine{product, units, itemTotal / units});
+                        result.linesPurchased++;
+                    } else {
+                        result.linesRejected++;
+                    }
+                }
+                double discount = machine.applyPromotions(basket);
+                total -= discount;
+                result.discounts += discount;
+                if (basket.empty()) {
+                    result.emptyBaskets++;  // every line was rejected; nothing to pay for
+                } else if (cashBox != nullptr) {
+                    long long priceCents = llround(total * 100.0);
+                    bool paid = cashBox->acceptPayment(cashBox->tenderFor(priceCents), priceCents, change);
+                    machine.settleBasket(reserved, paid, total, VendingMachine::countDistinctProducts(basket), customer(rng));
+                    if (paid) {
+                        result.revenue += total;
+                        result.baskets++;
+                    } else {
+                        result.declined++;
+                    }
+                } else if (payments != nullptr) {
+                    // Counted by the payment stage once the gateway answers
+                    payments->submit(reserved, total, VendingMachine::countDistinctProducts(basket), customer(rng));
+                } else {
+                    machine.completeBasket(total, VendingMachine::countItems(basket),
+                                           VendingMachine::countDistinctProducts(basket), customer(rng));
+                    result.revenue += total;
+                    result.baskets++;
+                }
+            }
+
+            if (admission != nullptr) {
+                admission->finish(admittedAt);
+            }
+            chrono::duration<double, micro> latency = chrono::steady_clock::now() - issued;
+            result.latenciesMicros.push_back(latency.count());
+            if (priority == PRIORITY_PURCHASE) {
+                result.basketLatenciesMicros.push_back(latency.count());
+            }
+        }
+    }
+
+public:
+    LoadGenerator(VendingMachine& machine, const LoadGeneratorConfig& config)
+        : machine(machine), config(config),
+          popularity(machine.getProductCount(), config.zipfExponent),
+          rankToProduct(machine.getProductCount()), payments(nullptr), cashBox(nullptr), admission(nullptr) {
+        for (size_t i = 0; i < rankToProduct.size(); ++i) {
+            rankToProduct[i] = i;
+        }
+        mt19937_64 rng(config.seed);
+        shuffle(rankToProduct.begin(), rankToProduct.end(), rng);
+    }
+
+    // Workers reserve basket lines and hand them to stage instead of buying outright
+    void setPaymentStage(PaymentStage* stage) { payments = stage; }
+
+    // Every request must be admitted by controller before it runs; shed requests are counted
+    void setAdmissionController(AdmissionController* controller) { admission = controller; }
+
+    // Customers pay each basket in cash; restocks also top the hoppers back up to coinLevel
+    void setCashBox(ChangeMaker* box, int coinLevel) {
+        cashBox = box;
+        coinLevels.assign(box != nullptr ? box->getDenominationCount() : 0, coinLevel);
+    }
+
+    // Generates a catalog of any size, cycling through all four product types.
+    // distinctNames > 0 repeats names, like the same drink stocked in many machines.
+    static void populateCatalog(VendingMachine& machine, size_t catalogSize, int stock, unsigned long seed,
+                                size_t distinctNames = 0) {
+        mt19937_64 rng(seed);
+        uniform_real_distribution<double> price(0.75, 6.00);
+        for (size_t i = 0; i < catalogSize; ++i) {
+            string name = "Item #" + to_string((distinctNames > 0 ? i % distinctNames : i) + 1);
+            double basePrice = price(rng);
+            switch (i % 4) {
+                case 0: machine.addProduct(new DiscountedProduct(name, basePrice, stock, 5 + i % 20)); break;
+                case 1: machine.addProduct(new Beverage(name, basePrice, stock, i % 8 == 1, 0.33)); break;
+                case 2: machine.addProduct(new LimitedTimeProduct(name, basePrice, stock, basePrice * 0.8, 30)); break;
+                default: machine.addProduct(new Product(name, basePrice, stock)); break;
+            }
+        }
+    }
+
+    // Builds the catalog described by --catalog, --catalog-size, --restock-quantity, --seed and
+    // --distinct-names. A trace must be replayed with the options it was recorded with.
+    static bool buildCatalog(int argc, char* argv[], VendingMachine& machine) {
+        size_t catalogSize = CommandLineOptions::getInt(argc, argv, "catalog-size", 0);
+        int restockQuantity = CommandLineOptions::getInt(argc, argv, "restock-quantity", 1000);
+        string catalogFile = CommandLineOptions::get(argc, argv, "catalog", "");
+        if (!catalogFile.empty()) {
+            return CatalogLoader::loadFile(catalogFile, machine);
+        }
+        if (catalogSize == 0) {
+            addDefaultCatalog(machine);
+            for (size_t i = 0; i < machine.getProductCount(); ++i) {
+                machine.restockProduct(i, restockQuantity);
+            }
+        } else {
+            populateCatalog(machine, catalogSize, restockQuantity, CommandLineOptions::getInt(argc, argv, "seed", 42),
+                            CommandLineOptions::getInt(argc, argv, "distinct-names", 0));
+        }
+        return true;
+    }
+
+    LoadGeneratorReport run() {
+        LoadGeneratorReport report = LoadGeneratorReport();
+        if (machine.getProductCount() == 0 || config.threads <= 0) return report;
+
+        vector<WorkerResult> results(config.threads);
+        vector<thread> workers;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        chrono::steady_clock::time_point stop = start + chrono::duration_cast<chrono::steady_clock::duration>(
+            chrono::duration<double>(config.durationSeconds));
+
+        for (int i = 0; i < config.threads; ++i) {
+            workers.push_back(thread(&LoadGenerator::runWorker, this, i, start, stop, ref(results[i])));
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        if (payments != nullptr) {
+            payments->drain();  // baskets still in flight count once they are answered
+            report.baskets = payments->getApprovedCount();
+            report.declined = payments->getDeclinedCount();
+            report.revenue = payments->getApprovedRevenue();
+        }
+        report.elapsedSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        for (const auto& result : results) {
+            report.baskets += result.baskets;
+            report.declined += result.declined;
+            report.emptyBaskets += result.emptyBaskets;
+            report.restocks += result.restocks;
+            report.reports += result.reports;
+            report.shed += result.shed;
+            report.linesPurchased += result.linesPurchased;
+            report.linesRejected += result.linesRejected;
+            report.revenue += result.revenue;
+            report.discounts += result.discounts;
+            report.retries += result.retries;
+            report.retryMismatches += result.retryMismatches;
+            report.latenciesMicros.insert(report.latenciesMicros.end(),
+                                          result.latenciesMicros.begin(), result.latenciesMicros.end());
+            report.basketLatenciesMicros.insert(report.basketLatenciesMicros.end(),
+                                                result.basketLatenciesMicros.begin(), result.basketLatenciesMicros.end());
+        }
+        sort(report.latenciesMicros.begin(), report.latenciesMicros.end());
+        sort(report.basketLatenciesMicros.begin(), report.basketLatenciesMicros.end());
+        return report;
+    }
+
+    static double percentile(const vector<double>& sorted, double p) {
+        if (sorted.empty()) return 0.0;
+        size_t index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+        return sorted[min(index, sorted.size() - 1)];
+    }
+
+    static void printReport(const LoadGeneratorReport& report) {
+        long operations = report.baskets + report.declined + report.restocks + report.reports;
+        cout << "\n=== Load Generator Report ===\n"
+             << "Elapsed: " << fixed << setprecision(2) << report.elapsedSeconds << " s\n"
+             << "Operations: " << operations << " (" << report.baskets << " paid baskets, "
+             << report.declined << " declined, " << report.restocks << " restocks, " << report.reports << " reports)\n"
+             << "Throughput: " << operations / report.elapsedSeconds << " ops/s, "
+             << report.linesPurchased / report.elapsedSeconds << " items/s\n"
+             << "Lines purchased: " << report.linesPurchased << ", rejected: " << report.linesRejected
+             << " (" << report.emptyBaskets << " baskets rejected outright)\n"
+             << "Revenue: $" << report.revenue << " (promotions: -$" << report.discounts << ")\n"
+             << "Latency (us): p50 " << percentile(report.latenciesMicros, 50)
+             << ", p90 " << percentile(report.latenciesMicros, 90)
+             << ", p99 " << percentile(report.latenciesMicros, 99)
+             << ", p99.9 " << percentile(report.latenciesMicros, 99.9)
+             << ", max " << (report.latenciesMicros.empty() ? 0.0 : report.latenciesMicros.back()) << endl;
+        if (report.reports > 0 || report.shed > 0) {
+            cout << "Basket latency (us): p50 " << percentile(report.basketLatenciesMicros, 50)
+                 << ", p99 " << percentile(report.basketLatenciesMicros, 99)
+                 << ", p99.9 " << percentile(report.basketLatenciesMicros, 99.9) << endl;
+        }
+        if (report.shed > 0) {
+            cout << "Shed by admission control: " << report.shed << " requests" << endl;
+        }
+        if (report.retries > 0) {
+            cout << "Retried lines: " << report.retries << " (" << report.retryMismatches
+                 << " answered differently from the original)" << endl;
+        }
+    }
+
+    // Random mix of all promotion types, to measure basket pricing with many active rules
+    static void generateSyntheticPromotions(vector<PromotionRule>& rules, long count, size_t productCount,
+                                            unsigned long seed) {
+        if (count <= 0 || productCount == 0) return;
+
+        mt19937_64 rng(seed ^ 0x9e3779b9);
+        uniform_int_distribution<size_t> product(0, productCount - 1);
+        uniform_int_distribution<int> category(0, CATEGORY_BUILTIN_COUNT - 1);
+        uniform_real_distribution<double> percent(2, 25);
+        for (long i = 0; i < count; ++i) {
+            PromotionRule rule;
+            rule.type = static_cast<PromotionType>(i % 4);
+            rule.targetsCategory = i % 10 == 0;
+            rule.product = product(rng);
+            rule.category = static_cast<CategoryId>(category(rng));
+            rule.percent = percent(rng);
+            rule.buyQuantity = 2;
+            rule.freeQuantity = 1;
+            rule.partnerProduct = product(rng);
+            rule.startHour = 16;
+            rule.endHour = 19;
+            rules.push_back(rule);
+        }
+    }
+
+    // Entry point for --loadgen
+    static int runFromCommandLine(int argc, char* argv[]) {
+        LoadGeneratorConfig config;
+        config.catalogSize = CommandLineOptions::getInt(argc, argv, "catalog-size", 0);
+        config.zipfExponent = CommandLineOptions::getDouble(argc, argv, "zipf", 1.0);
+        config.minBasketSize = CommandLineOptions::getInt(argc, argv, "basket-min", 1);
+        config.maxBasketSize = CommandLineOptions::getInt(argc, argv, "basket-max", 4);
+        config.maxQuantity = CommandLineOptions::getInt(argc, argv, "max-quantity", 2);
+        config.restockRatio = CommandLineOptions::getDouble(argc, argv, "restock-ratio", 0.05);
+        config.reportRatio = CommandLineOptions::getDouble(argc, argv, "report-ratio", 0.0);
+        config.restockQuantity = CommandLineOptions::getInt(argc, argv, "restock-quantity", 1000);
+        config.arrivalRate = CommandLineOptions::getDouble(argc, argv, "rate", 0.0);
+        config.threads = CommandLineOptions::getInt(argc, argv, "threads", 4);
+        config.durationSeconds = CommandLineOptions::getDouble(argc, argv, "duration", 5.0);
+        config.seed = CommandLineOptions::getInt(argc, argv, "seed", 42);
+        config.customers = CommandLineOptions::getInt(argc, argv, "customers", 100000);
+        config.retryRatio = CommandLineOptions::getDouble(argc, argv, "retry-ratio", 0.0);
+
+        if (config.minBasketSize < 1 || config.maxBasketSize < config.minBasketSize ||
+            config.maxQuantity < 1 || config.threads < 1 || config.customers < 1) {  // Added validation
+            cout << "Invalid load generator configuration." << endl;
+            return 1;
+        }
+
+        VendingMachine machine("Load Test");
+        machine.setVerbose(false);
+        if (!buildCatalog(argc, argv, machine)) return 1;
+
+        // Optional price and category indexes, kept current by the repricer below
+        unique_ptr<CatalogIndex> catalogIndex;
+        if (CommandLineOptions::has(argc, argv, "catalog-index")) {
+            catalogIndex.reset(new CatalogIndex());
+            machine.attachCatalogIndex(catalogIndex.get());
+        }
+
+        // Optional low-stock tracking, checked against a scan of every slot after the run
+        int lowStock = CommandLineOptions::getInt(argc, argv, "low-stock", -1);
+        unique_ptr<RestockMonitor> restockMonitor;
+        if (lowStock >= 0) {
+            restockMonitor.reset(new RestockMonitor(lowStock));
+            machine.attachRestockMonitor(restockMonitor.get());
+        }
+
+        // Optional spiral grid, checked against each product's stock after the run
+        string gridSize = CommandLineOptions::get(argc, argv, "planogram", "");
+        unique_ptr<Planogram> planogram;
+        if (!gridSize.empty()) {
+            size_t rows = 0, columns = 0;
+            if (sscanf(gridSize.c_str(), "%zux%zu", &rows, &columns) != 2 || rows == 0 || columns == 0) {  // Added validation
+                cout << "Invalid planogram size, expected ROWSxCOLUMNS." << endl;
+                return 1;
+            }
+            long spiralCapacity = CommandLineOptions::getInt(argc, argv, "spiral-capacity", 10);
+            if (spiralCapacity <= 0 || spiralCapacity > 65535) {  // Added validation
+                cout << "Invalid spiral capacity, expected 1-65535 units." << endl;
+                return 1;
+            }
+            string policy = CommandLineOptions::get(argc, argv, "spiral-policy", "first");
+            planogram.reset(new Planogram(rows, columns, policy == "fullest" ? SPIRAL_FULLEST
+                                                         : policy == "emptiest" ? SPIRAL_EMPTIEST : SPIRAL_FIRST));
+            planogram->assignInOrder(machine.getProductCount(), static_cast<unsigned short>(spiralCapacity));
+            machine.attachPlanogram(planogram.get());
+        }
+
+        // Optional trace of every request, starting from the freshly built catalog
+        string traceFile = CommandLineOptions::get(argc, argv, "record-trace", "");
+        unique_ptr<TraceRecorder> trace;
+        if (!traceFile.empty()) {
+            trace.reset(new TraceRecorder(traceFile, machine.getProductCount()));
+            machine.attachTraceRecorder(trace.get());
+        }
+
+        NameArena::displayStats();
+        cout << "Running load: " << machine.getProductCount() << " products, "
+             << config.threads << " threads, zipf s=" << config.zipfExponent
+             << ", basket " << config.minBasketSize << "-" << config.maxBasketSize
+             << ", rate " << (config.arrivalRate > 0 ? to_string(config.arrivalRate) + " ops/s" : "closed loop")
+             << ", " << config.durationSeconds << " s" << endl;
+
+        SalesAnalytics analytics(60, 60);  // one hour of per-minute buckets
+        machine.attachAnalytics(&analytics);
+        SalesSketches sketches;
+        machine.attachSketches(&sketches);
+        TopSellerTracker topSellers(CommandLineOptions::getInt(argc, argv, "top-capacity", 256), 1, 3600);
+        machine.attachTopSellers(&topSellers);
+
+        DynamicPricingEngine pricingEngine(DynamicPricingEngine::defaultConfig());
+        bool dynamicPricing = CommandLineOptions::has(argc, argv, "dynamic-pricing");
+        if (dynamicPricing) {
+            machine.attachPricingEngine(&pricingEngine);
+        }
+
+        // Optional background repricer: publishes a catalog-wide price change every interval
+        long repriceIntervalMs = CommandLineOptions::getInt(argc, argv, "reprice-interval-ms", 0);
+        atomic<bool> loadRunning(true);
+        long repricings = 0;
+        thread repricer;
+        if (repriceIntervalMs > 0) {
+            repricer = thread([&machine, &loadRunning, &repricings, repriceIntervalMs, &config]() {
+                mt19937_64 rng(config.seed ^ 0x5eed);
+                uniform_real_distribution<double> drift(0.95, 1.05);
+                vector<double> listPrices(machine.getProductCount());
+                for (size_t i = 0; i < listPrices.size(); ++i) {
+                    listPrices[i] = machine.getProduct(i)->getBasePrice();
+                }
+                while (loadRunning.load()) {
+                    this_thread::sleep_for(chrono::milliseconds(repriceIntervalMs));
+                    vector<pair<size_t, double>> changes(listPrices.size());
+                    for (size_t i = 0; i < listPrices.size(); ++i) {
+                        changes[i] = make_pair(i, listPrices[i] * drift(rng));
+                    }
+                    machine.repriceProducts(changes);
+                    repricings++;
+                }
+            });
+        }
+
+        vector<PromotionRule> rules;
+        string promotionFile = CommandLineOptions::get(argc, argv, "promotions", "");
+        if (!promotionFile.empty()) {
+            ifstream file(promotionFile);
+            PromotionEngine::parseRules(file, rules);
+        }
+        generateSyntheticPromotions(rules, CommandLineOptions::getInt(argc, argv, "synthetic-promotions", 0),
+                                    machine.getProductCount(), config.seed);
+        PromotionEngine promotions;
+        if (!rules.empty()) {
+            promotions.compile(rules, machine.getProductCategories());
+            machine.attachPromotions(&promotions);
+            cout << "Active promotions: " << promotions.size() << endl;
+        }
+
+        // Optional event bus: analytics, SalesTracker and the pricing engine consume from it
+        SalesTrackerConsumer trackerConsumer;
+        unique_ptr<SalesEventBus> eventBus;
+        if (CommandLineOptions::has(argc, argv, "event-bus")) {
+            vector<SalesEventConsumer*> consumers = {&analytics, &trackerConsumer, &sketches, &topSellers};
+            if (dynamicPricing) {
+                consumers.push_back(&pricingEngine);
+            }
+            eventBus.reset(new SalesEventBus(consumers));
+            machine.attachEventBus(eventBus.get());
+        }
+
+        // Optional receipt log written by the background printer
+        string receiptFile = CommandLineOptions::get(argc, argv, "receipts", "");
+        ofstream receiptStream;
+        unique_ptr<ReceiptPrinter> receipts;
+        if (!receiptFile.empty()) {
+            receiptStream.open(receiptFile);
+            receipts.reset(new ReceiptPrinter(receiptStream, 1 << 16));
+            machine.attachReceiptPrinter(receipts.get());
+        }
+
+        // Optional replication to an in-process replica over a (lossy) loopback link
+        long replicateIntervalMs = CommandLineOptions::getInt(argc, argv, "replicate-interval-ms", 0);
+        LoopbackTransport toReplica(CommandLineOptions::getDouble(argc, argv, "replication-loss", 0.0), config.seed);
+        LoopbackTransport toMachine;
+        unique_ptr<InventoryReplicator> replicator;
+        unique_ptr<InventoryReplica> replica;
+        thread replicationThread;
+        if (replicateIntervalMs > 0) {
+            replicator.reset(new InventoryReplicator(machine));
+            replica.reset(new InventoryReplica(toReplica, &toMachine));
+            replicator->addReplica(&toReplica, &toMachine);
+            replicationThread = thread([&replicator, &replica, &loadRunning, replicateIntervalMs]() {
+                while (loadRunning.load()) {
+                    this_thread::sleep_for(chrono::milliseconds(replicateIntervalMs));
+                    replicator->ship();
+                    replica->poll();
+                }
+            });
+        }
+
+        // Optional asynchronous payment: a simulated gateway with the given round trip
+        double paymentLatencyMs = CommandLineOptions::getDouble(argc, argv, "payment-latency-ms", 0.0);
+        unique_ptr<SimulatedPaymentGateway> gateway;
+        unique_ptr<PaymentStage> payments;
+        if (paymentLatencyMs > 0) {
+            gateway.reset(new SimulatedPaymentGateway(paymentLatencyMs,
+                                                      CommandLineOptions::getDouble(argc, argv, "payment-jitter-ms", 0.0),
+                                                      CommandLineOptions::getDouble(argc, argv, "decline-rate", 0.0),
+                                                      config.seed));
+            payments.reset(new PaymentStage(machine, *gateway, CommandLineOptions::getInt(argc, argv, "max-in-flight", 4096)));
+        }
+
+        // Optional cash payment with change from limited coin hoppers
+        unique_ptr<ChangeMaker> cashBox;
+        int coinStock = CommandLineOptions::getInt(argc, argv, "coin-stock", 50);
+        if (CommandLineOptions::has(argc, argv, "cash")) {
+            cashBox.reset(new ChangeMaker(ChangeMaker::parseDenominations(
+                CommandLineOptions::get(argc, argv, "denominations", "1,5,10,25,100,500,1000,2000"))));
+            cashBox->topUp(vector<int>(cashBox->getDenominationCount(), coinStock));
+        }
+
+        // Keyed purchases: retries are answered from the dedupe table
+        unique_ptr<IdempotencyTable> requests;
+        if (config.retryRatio > 0 || CommandLineOptions::has(argc, argv, "idempotency")) {
+            requests.reset(new IdempotencyTable(CommandLineOptions::getInt(argc, argv, "dedupe-capacity", 1 << 20),
+                                                CommandLineOptions::getInt(argc, argv, "dedupe-ttl", 300)));
+            machine.attachIdempotencyTable(requests.get());
+        }
+
+        // Optional admission control: bounded per-priority queues and an adaptive concurrency limit
+        unique_ptr<AdmissionController> admission;
+        if (CommandLineOptions::has(argc, argv, "admission")) {
+            admission.reset(new AdmissionController(CommandLineOptions::getInt(argc, argv, "admission-limit", 4),
+                                                    CommandLineOptions::getInt(argc, argv, "admission-max-limit", 64),
+                                                    CommandLineOptions::getDouble(argc, argv, "admission-target-us", 50.0),
+                                                    CommandLineOptions::getDouble(argc, argv, "max-queue-wait-us", 2000.0),
+                                                    CommandLineOptions::getInt(argc, argv, "queue-depth", 64)));
+        }
+
+        LoadGenerator generator(machine, config);
+        generator.setPaymentStage(payments.get());
+        generator.setAdmissionController(admission.get());
+        generator.setCashBox(cashBox.get(), coinStock);
+        LoadGeneratorReport report = generator.run();
+        if (payments) {
+            payments->drain();
+        }
+        if (eventBus) {
+            eventBus->flush();
+        }
+        if (receipts) {
+            receipts->flush();
+            cout << "Receipts written to " << receiptFile << " (" << receipts->droppedEvents()
+                 << " dropped on full queues)" << endl;
+        }
+        loadRunning.store(false);
+        if (repricer.joinable()) {
+            repricer.join();
+        }
+        if (replicationThread.joinable()) {
+            replicationThread.join();
+        }
+        if (trace) {
+            trace->flush();
+            cout << "Trace of " << trace->getRecordCount() << " requests written to " << traceFile << endl;
+        }
+        printReport(report);
+        if (machine.getUnprintedWarnings() > 0) {
+            cout << "Out-of-stock warnings (not printed without --receipts): " << machine.getUnprintedWarnings() << endl;
+        }
+        if (repriceIntervalMs > 0) {
+            cout << "Catalog repricings published during the run: " << repricings << endl;
+        }
+        if (eventBus) {
+            eventBus->displayStats();
+        }
+        if (payments) {
+            payments->displayStats();
+        }
+        if (cashBox) {
+            cashBox->displayStats();
+        }
+        if (requests) {
+            requests->displayStats();
+        }
+        if (admission) {
+            admission->displayStats();
+        }
+        sketches.displayReport();
+        if (replicator) {
+            // Ships what changed since the thread stopped; a few more rounds let a replica
+            // that lost the last batches resynchronize
+            for (int round = 0; round < 10; ++round) {
+                replicator->ship();
+                replica->poll();
+                if (replica->isSynced() && replica->getSequence() == replicator->getSequence()) break;
+            }
+            vector<size_t> allSlots(machine.getProductCount());
+            for (size_t i = 0; i < allSlots.size(); ++i) {
+                allSlots[i] = i;
+            }
+            vector<int> stock;
+            vector<double> basePrice;
+            machine.readReplicatedState(allSlots, stock, basePrice);
+            size_t mismatches = 0;
+            for (size_t i = 0; i < allSlots.size(); ++i) {
+                if (replica->getStock(i) != stock[i] ||
+                    llround(replica->getBasePrice(i) * 100.0) != ReplicationCodec::toCents(basePrice[i])) {
+                    mismatches++;
+                }
+            }
+            replicator->displayStats();
+            toReplica.displayStats("Machine -> replica");
+            toMachine.displayStats("Replica -> machine");
+            cout << "Replica " << (mismatches == 0 ? "converged" : "diverged") << ": "
+                 << mismatches << " of " << allSlots.size() << " slots differ" << endl;
+        }
+        if (dynamicPricing) {
+            double lowest = 1e9, highest = 0.0;
+            for (size_t i = 0; i < machine.getProductCount(); ++i) {
+                double multiplier = pricingEngine.multiplier(i, Clock::now());
+                lowest = min(lowest, multiplier);
+                highest = max(highest, multiplier);
+            }
+            cout << "Dynamic price multipliers: " << setprecision(3) << lowest << " - " << highest << endl;
+        }
+
+        chrono::steady_clock::time_point queryStart = chrono::steady_clock::now();
+        time_t now = Clock::now();
+        vector<double> byProduct = analytics.revenueByProduct(now - 3600, now + 1);
+        size_t best = max_element(byProduct.begin(), byProduct.end()) - byProduct.begin();
+        cout << "\nRevenue by category (last hour):" << endl;
+        analytics.displayCategoryReport(now - 3600, now + 1);
+        cout << "Best seller: " << machine.getProduct(best)->getName()
+             << " ($" << byProduct[best] << ")" << endl;
+
+        // Space-Saving estimates next to the exact unit counts from the analytics columns
+        int topWindow = CommandLineOptions::getInt(argc, argv, "top-window", 60);
+        size_t topK = CommandLineOptions::getInt(argc, argv, "top-k", 10);
+        cout << "\nTop " << topK << " sellers (last " << topWindow << " s, units estimated / exact):" << endl;
+        for (const SpaceSavingSummary::Entry& entry : topSellers.topSellers(topK, topWindow, now)) {
+            cout << "  " << machine.getProduct(entry.product)->getName() << ": " << entry.count
+                 << " (>= " << entry.count - entry.error << ") / "
+                 << analytics.productUnitsBetween(entry.product, now - topWindow + 1, now + 1) << endl;
+        }
+        cout << "Analytics queries: " << fixed << setprecision(3)
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - queryStart).count() << " ms" << endl;
+
+        if (catalogIndex) {
+            // The same kiosk queries through the index and by scanning, which must agree
+            auto kioskQueries = [&machine]() {
+                vector<size_t> drinks = machine.findProductsByCategory(CATEGORY_CARBONATED_BEVERAGE, 0.0, 2.0);
+                vector<size_t> still = machine.findProductsByCategory(CATEGORY_NON_CARBONATED_BEVERAGE, 0.0, 2.0);
+                drinks.insert(drinks.end(), still.begin(), still.end());
+                vector<vector<size_t>> answers = {drinks, machine.findProductsOnOffer(),
+                                                  machine.findProductsByPrice(1.0, 1.5)};
+                return answers;
+            };
+            catalogIndex->displayStats();
+            chrono::steady_clock::time_point indexStart = chrono::steady_clock::now();
+            vector<vector<size_t>> indexed = kioskQueries();
+            double indexMicros = chrono::duration<double, micro>(chrono::steady_clock::now() - indexStart).count();
+            machine.attachCatalogIndex(nullptr);
+            chrono::steady_clock::time_point scanStart = chrono::steady_clock::now();
+            vector<vector<size_t>> scanned = kioskQueries();
+            double scanMicros = chrono::duration<double, micro>(chrono::steady_clock::now() - scanStart).count();
+            cout << "Catalog queries: " << indexed[0].size() << " drinks under $2, " << indexed[1].size()
+                 << " on offer, " << indexed[2].size() << " at $1.00-$1.50; index " << indexMicros << " us, scan "
+                 << scanMicros << " us (" << (indexed == scanned ? "same" : "DIFFERENT") << " results)" << endl;
+        }
+
+        if (restockMonitor) {
+            restockMonitor->displayStats();
+            vector<size_t> scanned;
+            for (size_t i = 0; i < machine.getProductCount(); ++i) {
+                if (machine.getProduct(i)->getStockQuantity() <= lowStock) scanned.push_back(i);
+            }
+            cout << "Needs restock: " << scanned.size() << " slots at or below " << lowStock << " ("
+                 << (restockMonitor->getProductsNeedingRestock(0) == scanned ? "matches" : "DIFFERS FROM")
+                 << " a full scan)" << endl;
+        }
+
+        if (planogram) {
+            size_t mismatched = 0;
+            long overflow = 0;
+            for (size_t i = 0; i < machine.getProductCount(); ++i) {
+                if (planogram->getUnits(i) != machine.getProduct(i)->getStockQuantity()) mismatched++;
+                overflow += planogram->getOverflow(i);
+            }
+            if (planogram->getRows() * planogram->getColumns() <= 100) {
+                planogram->displayGrid();
+            } else {
+                cout << "Planogram: " << planogram->getRows() << "x" << planogram->getColumns() << " spirals, "
+                     << planogram->getEmptySpiralCount() << " empty" << endl;
+            }
+            cout << "Planogram stock: " << overflow << " units in overflow, " << mismatched
+                 << " products disagree with their stock count" << endl;
+        }
+        return 0;
+    }
+};
+
+// Fleet simulator class - discrete-event simulation of a fleet of machines on a virtual
+// clock. Customer arrivals, restock visits and price reviews are events in a time-ordered
+// queue; the unchanged machine and product classes handle each one with Clock set to the
+// event's time, so limited-time offers expire as the virtual months pass. Everything runs
+// on one thread from one seeded generator, so the same inputs give bit-identical results.
+class FleetSimulator {
+public:
+    struct Config {
+        int machines;
+        size_t catalogSize;       // products per machine
+        double days;
+        double arrivalsPerHour;   // per machine, averaged over the day
+        double restockDays;       // interval between restock visits to a machine
+        int parLevel;             // restock visits fill every slot up to this many units
+        int restockThreshold;     // -1: visit every machine each restockDays; otherwise a route every
+                                  // restockDays visits only machines with a slot at or below this
+        double priceReviewDays;   // interval between price reviews of a machine, 0 = never
+        double zipfExponent;
+        unsigned long seed;
+        time_t startTime;         // virtual time of the first event
+    };
+
+    struct Result {
+        long events;
+        long baskets;
+        long unitsSold;
+        long lostToStockout;      // basket lines refused because the slot ran low
+        long lostToExpiry;        // basket lines for limited-time offers that had expired
+        long restockVisits;
+        long unitsRestocked;
+        long stockAlerts;         // low-stock crossings raised by the restock monitor
+        long priceChanges;
+        double revenue;
+        unsigned long long fingerprint;  // hash of every outcome and of the final stock
+    };
+
+private:
+    enum EventType : unsigned char {
+        EVENT_ARRIVAL,
+        EVENT_RESTOCK,
+        EVENT_RESTOCK_ROUTE,      // fleet-wide, machine is unused
+        EVENT_PRICE_REVIEW
+    };
+
+    struct Event {
+        double time;                // seconds since startTime
+        unsigned long long sequence;  // breaks ties in scheduling order
+        EventType type;
+        size_t machine;
+
+        bool operator>(const Event& other) const {
+            return time != other.time ? time > other.time : sequence > other.sequence;
+        }
+    };
+
+    // Relative customer traffic for each hour of the day; averages to 1
+    static const double* hourlyProfile() {
+        static const double profile[24] = {0.2, 0.1, 0.1, 0.1, 0.1, 0.2, 0.5, 1.2, 1.8, 1.3, 1.1, 1.4,
+                                           2.0, 1.8, 1.2, 1.1, 1.3, 1.7, 1.9, 1.5, 1.1, 0.8, 0.6, 0.4};
+        return profile;
+    }
+
+    Config config;
+    mt19937_64 rng;
+    priority_queue<Event, vector<Event>, greater<Event>> events;
+    unsigned long long nextSequence;
+    vector<unique_ptr<VendingMachine>> machines;
+    vector<unique_ptr<SalesAnalytics>> analytics;  // per machine, one bucket per day
+    vector<vector<size_t>> rankToProduct;          // per machine, so popularity differs by site
+    unique_ptr<RestockMonitor> monitor;            // only when routing restocks by threshold
+    vector<RestockMonitor::Alert> alerts;
+    ZipfDistribution popularity;
+    Result result;
+
+    void schedule(double time, EventType type, size_t machine) {
+        if (time < config.days * 86400.0) {
+            events.push(Event{time, nextSequence++, type, machine});
+        }
+    }
+
+    // Daily analytics buckets kept per machine: a price review period and the final report
+    size_t analyticsDays() const {
+        return static_cast<size_t>(max(config.priceReviewDays, 7.0)) + 2;
+    }
+
+    void mix(unsigned long long value) {
+        result.fingerprint = (result.fingerprint ^ value) * 1099511628211ULL;  // FNV-1a, one word at a time
+    }
+
+    void scheduleArrival(double now, size_t machine) {
+        double hourly = config.arrivalsPerHour * hourlyProfile()[static_cast<long long>(now / 3600.0) % 24];
+        schedule(now + exponential_distribution<double>(hourly / 3600.0)(rng), EVENT_ARRIVAL, machine);
+    }
+
+    void serveCustomer(size_t index) {
+        VendingMachine& machine = *machines[index];
+        int lines = uniform_int_distribution<int>(1, 3)(rng);
+        double total = 0.0;
+        int items = 0;
+        for (int i = 0; i < lines; ++i) {
+            size_t product = rankToProduct[index][popularity.sample(rng)];
+            int quantity = uniform_int_distribution<int>(1, 2)(rng);
+            const Product* slot = machine.getProduct(product);
+            // Customers look before they pay, so refusals never reach the machine's stock warnings
+            double itemTotal = 0.0;
+            bool bought = false;
+            if (slot->hasExpired()) {
+                result.lostToExpiry++;
+            } else if (slot->getStockQuantity() < quantity) {
+                result.lostToStockout++;
+            } else {
+                bought = machine.purchaseProduct(product, quantity, itemTotal);
+            }
+            if (bought) {
+                total += itemTotal;
+                items += quantity;
+            }
+            mix(product << 2 | (bought ? 1 : 0));
+            mix(static_cast<unsigned long long>(llround(itemTotal * 100.0)));
+        }
+        if (items > 0) {
+            machine.completeBasket(total, items);
+            result.baskets++;
+            result.unitsSold += items;
+            result.revenue += total;
+        }
+    }
+
+    void restock(size_t index) {
+        VendingMachine& machine = *machines[index];
+        for (size_t i = 0; i < machine.getProductCount(); ++i) {
+            const Product* slot = machine.getProduct(i);
+            int missing = config.parLevel - slot->getStockQuantity();
+            if (missing > 0 && !slot->hasExpired()) {
+                machine.restockProduct(i, missing);
+                result.unitsRestocked += missing;
+            } else if (monitor && slot->hasExpired()) {
+                machine.setLowStockThreshold(i, -1);  // an expired offer is never refilled
+            }
+        }
+        result.restockVisits++;
+    }
+
+    // Visits the machines the monitor flagged since the last route, neediest first
+    void runRestockRoute() {
+        monitor->drainAlerts(alerts);
+        result.stockAlerts += alerts.size();
+        for (const RestockMonitor::RouteStop& stop : monitor->planRoute()) {
+            restock(stop.machine);
+            mix(stop.machine);
+        }
+    }
+
+    // Cuts the price of slots that sold nothing since the last review and raises it on
+    // slots that sold more than a full load
+    void reviewPrices(size_t index, time_t now) {
+        VendingMachine& machine = *machines[index];
+        time_t since = now - static_cast<time_t>(config.priceReviewDays * 86400.0);
+        vector<size_t> slots(machine.getProductCount());
+        for (size_t i = 0; i < slots.size(); ++i) {
+            slots[i] = i;
+        }
+        vector<int> stock;
+        vector<double> basePrice;
+        machine.readReplicatedState(slots, stock, basePrice);
+
+        vector<pair<size_t, double>> changes;
+        for (size_t i = 0; i < slots.size(); ++i) {
+            int units = analytics[index]->productUnitsBetween(i, since, now + 1);
+            if (units == 0) {
+                changes.push_back(make_pair(i, basePrice[i] * 0.95));
+            } else if (units > config.parLevel) {
+                changes.push_back(make_pair(i, basePrice[i] * 1.05));
+            }
+        }
+        if (!changes.empty()) {
+            machine.repriceProducts(changes);
+            for (const auto& change : changes) {
+                mix(change.first << 32 ^ static_cast<unsigned long long>(llround(change.second * 100.0)));
+            }
+            result.priceChanges += changes.size();
+        }
+    }
+
+public:
+    FleetSimulator(const Config& config)
+        : config(config), rng(config.seed), nextSequence(0),
+          popularity(max<size_t>(config.catalogSize, 1), config.zipfExponent), result(Result()) {
+        result.fingerprint = 14695981039346656037ULL;
+    }
+
+    static Config defaultConfig() {
+        Config config;
+        config.machines = 100;
+        config.catalogSize = 40;
+        config.days = 90;
+        config.arrivalsPerHour = 3;
+        config.restockDays = 2;
+        config.parLevel = 24;
+        config.restockThreshold = -1;
+        config.priceReviewDays = 7;
+        config.zipfExponent = 0.8;
+        config.seed = 42;
+        config.startTime = 1767225600;  // 2026-01-01 00:00 UTC
+        return config;
+    }
+
+    Result run() {
+        Clock::setVirtualTime(config.startTime);  // offers are created relative to the virtual start
+        if (config.restockThreshold >= 0) {
+            monitor.reset(new RestockMonitor(config.restockThreshold));
+            schedule(config.restockDays * 86400.0, EVENT_RESTOCK_ROUTE, 0);
+        }
+        for (int m = 0; m < config.machines; ++m) {
+            machines.emplace_back(new VendingMachine("Site " + to_string(m + 1)));
+            VendingMachine& machine = *machines.back();
+            machine.setVerbose(false);
+            analytics.emplace_back(new SalesAnalytics(86400, analyticsDays()));
+            machine.attachAnalytics(analytics.back().get());
+            LoadGenerator::populateCatalog(machine, config.catalogSize, config.parLevel, config.seed + m);
+            if (monitor) {
+                machine.attachRestockMonitor(monitor.get());
+            }
+
+            vector<size_t> ranks(machine.getProductCount());
+            for (size_t i = 0; i < ranks.size(); ++i) {
+                ranks[i] = i;
+            }
+            shuffle(ranks.begin(), ranks.end(), rng);
+            rankToProduct.push_back(ranks);
+
+            uniform_real_distribution<double> phase(0.0, 1.0);
+            scheduleArrival(0.0, m);
+            double restockPhase = phase(rng);
+            if (!monitor) {
+                schedule(restockPhase * config.restockDays * 86400.0, EVENT_RESTOCK, m);
+            }
+            if (config.priceReviewDays > 0) {
+                schedule(phase(rng) * config.priceReviewDays * 86400.0, EVENT_PRICE_REVIEW, m);
+            }
+        }
+
+        while (!events.empty()) {
+            Event event = events.top();
+            events.pop();
+            time_t now = config.startTime + static_cast<time_t>(event.time);
+            Clock::setVirtualTime(now);
+            result.events++;
+            switch (event.type) {
+            case EVENT_ARRIVAL:
+                serveCustomer(event.machine);
+                scheduleArrival(event.time, event.machine);
+                break;
+            case EVENT_RESTOCK:
+                restock(event.machine);
+                schedule(event.time + config.restockDays * 86400.0, EVENT_RESTOCK, event.machine);
+                break;
+            case EVENT_RESTOCK_ROUTE:
+                runRestockRoute();
+                schedule(event.time + config.restockDays * 86400.0, EVENT_RESTOCK_ROUTE, 0);
+                break;
+            case EVENT_PRICE_REVIEW:
+                reviewPrices(event.machine, now);
+                schedule(event.time + config.priceReviewDays * 86400.0, EVENT_PRICE_REVIEW, event.machine);
+                break;
+            }
+        }
+
+        Clock::setVirtualTime(config.startTime + static_cast<time_t>(config.days * 86400.0));
+        for (const auto& machine : machines) {
+            for (size_t i = 0; i < machine->getProductCount(); ++i) {
+                mix(static_cast<unsigned long long>(machine->getProduct(i)->getStockQuantity()));
+            }
+        }
+        return result;
+    }
+
+    // Revenue by category over the last days of the run, summed across the fleet
+    void displayFleetReport(int days) const {
+        if (analytics.empty()) return;
+        SalesAnalytics fleet(86400, analyticsDays());
+        for (size_t i = 0; i < machines[0]->getProductCount(); ++i) {
+            fleet.registerProduct(machines[0]->getProduct(i)->getCategoryId());
+        }
+        for (const auto& store : analytics) {
+            fleet.merge(*store);
+        }
+        time_t end = Clock::now();
+        cout << "Fleet revenue by category (last " << days << " days):" << endl;
+        fleet.displayCategoryReport(end - days * 86400, end + 1);
+    }
+
+    static void printResult(const Result& result) {
+        cout << "Events: " << result.events << ", baskets: " << result.baskets
+             << ", units sold: " << result.unitsSold << ", revenue: $" << fixed << setprecision(2) << result.revenue << "\n"
+             << "Lost basket lines: " << result.lostToStockout << " to stockouts, "
+             << result.lostToExpiry << " to expired offers\n"
+             << "Restock visits: " << result.restockVisits << " (" << result.unitsRestocked << " units), price changes: "
+             << result.priceChanges << "\n";
+        if (result.stockAlerts > 0) {
+            cout << "Low-stock alerts: " << result.stockAlerts << "\n";
+        }
+        cout << "Fingerprint: " << hex << setw(16) << setfill('0') << result.fingerprint << dec << setfill(' ') << endl;
+    }
+
+    // Entry point for --simulate
+    static int runFromCommandLine(int argc, char* argv[]) {
+        Config config = defaultConfig();
+        config.machines = CommandLineOptions::getInt(argc, argv, "machines", config.machines);
+        config.catalogSize = CommandLineOptions::getInt(argc, argv, "catalog-size", config.catalogSize);
+        config.days = CommandLineOptions::getDouble(argc, argv, "days", config.days);
+        config.arrivalsPerHour = CommandLineOptions::getDouble(argc, argv, "arrivals-per-hour", config.arrivalsPerHour);
+        config.restockDays = CommandLineOptions::getDouble(argc, argv, "restock-days", config.restockDays);
+        config.parLevel = CommandLineOptions::getInt(argc, argv, "par-level", config.parLevel);
+        config.restockThreshold = CommandLineOptions::getInt(argc, argv, "restock-threshold", config.restockThreshold);
+        config.priceReviewDays = CommandLineOptions::getDouble(argc, argv, "price-review-days", config.priceReviewDays);
+        config.zipfExponent = CommandLineOptions::getDouble(argc, argv, "zipf", config.zipfExponent);
+        config.seed = CommandLineOptions::getInt(argc, argv, "seed", config.seed);
+        config.startTime = CommandLineOptions::getInt(argc, argv, "start-time", config.startTime);
+        long scenarios = CommandLineOptions::getInt(argc, argv, "scenarios", 1);
+
+        if (config.machines < 1 || config.catalogSize < 1 || config.days <= 0 || config.arrivalsPerHour <= 0 ||
+            config.restockDays <= 0 || config.parLevel < 1 || config.restockThreshold < -1 ||
+            config.restockThreshold >= config.parLevel || config.priceReviewDays < 0 ||
+            config.startTime <= 0 || scenarios < 1) {  // Added validation
+            cout << "Invalid simulation configuration." << endl;
+            return 1;
+        }
+
+        cout << "Simulating " << config.machines << " machines x " << config.catalogSize << " products for "
+             << config.days << " days, " << scenarios << " scenario(s) from seed " << config.seed << endl;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        long totalEvents = 0;
+        for (long s = 0; s < scenarios; ++s) {
+            Config scenario = config;
+            scenario.seed = config.seed + s;
+            FleetSimulator simulator(scenario);
+            Result result = simulator.run();
+            totalEvents += result.events;
+            if (scenarios == 1) {
+                printResult(result);
+                simulator.displayFleetReport(7);
+            } else {
+                cout << "Seed " << scenario.seed << ": revenue $" << fixed << setprecision(2) << result.revenue
+                     << ", lost " << result.lostToStockout << " + " << result.lostToExpiry
+                     << ", fingerprint " << hex << setw(16) << setfill('0') << result.fingerprint
+                     << dec << setfill(' ') << endl;
+            }
+        }
+        Clock::useRealTime();
+
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Wall time: " << setprecision(2) << elapsed << " s (" << setprecision(0)
+             << totalEvents / elapsed << " events/s)" << endl;
+        return 0;
+    }
+};
+
+// Stream buffer that discards everything written to it, for measuring console-bound work
+class NullStreamBuffer : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize count) override { return count; }
+};
+
+// Trace replayer class - drives a recorded trace against a freshly built machine, at the
+// recorded pace or as fast as possible, and reports throughput and latency. Each recorded
+// thread's requests stay in order on one replay worker.
+class TraceReplayer {
+private:
+    struct Record {
+        TraceRecordType type;
+        unsigned thread;
+        long long offsetMicros;  // since the start of the trace
+        size_t product;
+        int quantity;
+        unsigned long long requestId;
+        size_t repricing;        // index into repricings
+    };
+
+    struct WorkerResult {
+        long purchases = 0;
+        long purchased = 0;
+        long restocks = 0;
+        long releases = 0;  // reservations put back after a declined payment
+        long repricings = 0;
+        long displays = 0;
+        double revenue = 0.0;
+        vector<double> latenciesMicros;
+        vector<double> purchaseLatenciesMicros;
+    };
+
+    VendingMachine& machine;
+    vector<Record> records;
+    vector<vector<pair<size_t, double>>> repricings;
+    size_t productCount;
+    unsigned threadCount;  // distinct recorded threads
+
+    void runWorker(unsigned worker, unsigned workers, double speed,
+                   chrono::steady_clock::time_point start, WorkerResult& result) {
+        for (const Record& record : records) {
+            if (record.thread % workers != worker) continue;
+            chrono::steady_clock::time_point issued;
+            if (speed > 0) {
+                issued = start + chrono::duration_cast<chrono::steady_clock::duration>(
+                    chrono::duration<double, micro>(record.offsetMicros / speed));
+                if (issued > chrono::steady_clock::now()) {
+                    this_thread::sleep_until(issued);
+                    issued = chrono::steady_clock::now();  // oversleeping is the timer's latency, not the machine's
+                }
+            } else {
+                issued = chrono::steady_clock::now();
+            }
+
+            double itemTotal = 0.0;
+            switch (record.type) {
+            case TRACE_PURCHASE:
+                if (machine.purchaseProduct(record.product, record.quantity, itemTotal, record.requestId)) {
+                    result.purchased++;
+                    result.revenue += itemTotal;
+                }
+                result.purchases++;
+                break;
+            case TRACE_RESTOCK:
+                machine.restockProduct(record.product, record.quantity);
+                result.restocks++;
+                break;
+            case TRACE_RELEASE:
+                machine.releaseReservation(SalesEvent{SALES_EVENT_SALE, CATEGORY_GENERAL, record.quantity, 0,
+                                                      record.product, 0.0, 0, 0});
+                result.releases++;
+                break;
+            case TRACE_REPRICE:
+                machine.repriceProducts(repricings[record.repricing]);
+                result.repricings++;
+                break;
+            case TRACE_DISPLAY:
+                machine.displayProducts();
+                result.displays++;
+                break;
+            }
+
+            chrono::duration<double, micro> latency = chrono::steady_clock::now() - issued;
+            result.latenciesMicros.push_back(latency.count());
+            if (record.type == TRACE_PURCHASE) {
+                result.purchaseLatenciesMicros.push_back(latency.count());
+            }
+        }
+    }
+
+public:
+    TraceReplayer(VendingMachine& machine) : machine(machine), productCount(0), threadCount(0) {}
+
+    // Reads a trace written by TraceRecorder; false if it is missing or damaged
+    bool load(const string& path) {
+        ifstream file(path, ios::binary);
+        vector<unsigned char> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        const unsigned char* position = data.data();
+        const unsigned char* end = position + data.size();
+        if (data.size() < 8 || !equal(position, position + 8, TraceRecorder::magic())) return false;
+        position += 8;
+
+        unsigned long long count;
+        if (!ReplicationCodec::getVarint(position, end, count)) return false;
+        productCount = static_cast<size_t>(count);
+
+        long long offset = 0;
+        while (position < end) {
+            Record record = Record();
+            record.type = static_cast<TraceRecordType>(*position++);
+            unsigned long long delta, thread, product, requestId, changes;
+            long long quantity;
+            if (!ReplicationCodec::getVarint(position, end, delta) ||
+                !ReplicationCodec::getVarint(position, end, thread)) return false;
+            offset += static_cast<long long>(delta);
+            record.offsetMicros = offset;
+            record.thread = static_cast<unsigned>(thread);
+            threadCount = max(threadCount, record.thread + 1);
+
+            switch (record.type) {
+            case TRACE_PURCHASE:
+                if (!ReplicationCodec::getVarint(position, end, product) ||
+                    !ReplicationCodec::getSigned(position, end, quantity) ||
+                    !ReplicationCodec::getVarint(position, end, requestId)) return false;
+                record.product = static_cast<size_t>(product);
+                record.quantity = static_cast<int>(quantity);
+                record.requestId = requestId;
+                break;
+            case TRACE_RESTOCK:
+            case TRACE_RELEASE:
+                if (!ReplicationCodec::getVarint(position, end, product) ||
+                    !ReplicationCodec::getSigned(position, end, quantity)) return false;
+                record.product = static_cast<size_t>(product);
+                record.quantity = static_cast<int>(quantity);
+                break;
+            case TRACE_REPRICE:
+                if (!ReplicationCodec::getVarint(position, end, changes)) return false;
+                record.repricing = repricings.size();
+                repricings.emplace_back();
+                for (unsigned long long i = 0; i < changes; ++i) {
+                    long long cents;
+                    if (!ReplicationCodec::getVarint(position, end, product) ||
+                        !ReplicationCodec::getSigned(position, end, cents)) return false;
+                    repricings.back().push_back(make_pair(static_cast<size_t>(product), cents / 100.0));
+                }
+                break;
+            case TRACE_DISPLAY:
+                break;
+            default:
+                return false;
+            }
+            records.push_back(record);
+        }
+        return true;
+    }
+
+    size_t getRecordCount() const { return records.size(); }
+    size_t getProductCount() const { return productCount; }
+    unsigned getThreadCount() const { return threadCount; }
+
+    bool hasKeyedPurchases() const {
+        for (const Record& record : records) {
+            if (record.requestId != 0) return true;
+        }
+        return false;
+    }
+
+    // speed 0 replays as fast as possible; otherwise 1 is the recorded pace, 2 twice as fast.
+    // Latency is measured from each request's scheduled time, so falling behind shows up.
+    void run(unsigned workers, double speed) {
+        workers = max(workers, 1u);
+        vector<WorkerResult> results(workers);
+        for (WorkerResult& result : results) {
+            result.latenciesMicros.reserve(records.size() / workers + 1);
+        }
+        NullStreamBuffer discard;  // display output is formatted but not printed
+        streambuf* console = cout.rdbuf(&discard);
+        vector<thread> threads;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (unsigned w = 0; w < workers; ++w) {
+            threads.push_back(thread(&TraceReplayer::runWorker, this, w, workers, speed, start, ref(results[w])));
+        }
+        for (auto& worker : threads) {
+            worker.join();
+        }
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout.rdbuf(console);
+
+        WorkerResult total;
+        for (const WorkerResult& result : results) {
+            total.purchases += result.purchases;
+            total.purchased += result.purchased;
+            total.restocks += result.restocks;
+            total.releases += result.releases;
+            total.repricings += result.repricings;
+            total.displays += result.displays;
+            total.revenue += result.revenue;
+            total.latenciesMicros.insert(total.latenciesMicros.end(),
+                                         result.latenciesMicros.begin(), result.latenciesMicros.end());
+            total.purchaseLatenciesMicros.insert(total.purchaseLatenciesMicros.end(),
+                                                 result.purchaseLatenciesMicros.begin(),
+                                                 result.purchaseLatenciesMicros.end());
+        }
+        sort(total.latenciesMicros.begin(), total.latenciesMicros.end());
+        sort(total.purchaseLatenciesMicros.begin(), total.purchaseLatenciesMicros.end());
+
+        const vector<double>& all = total.latenciesMicros;
+        const vector<double>& bought = total.purchaseLatenciesMicros;
+        cout << "\n=== Trace Replay Report ===\n"
+             << "Elapsed: " << fixed << setprecision(2) << elapsed << " s, ";
+        if (speed > 0) {
+            cout << "paced at " << speed << "x";
+        } else {
+            cout << "maximum speed";
+        }
+        cout << ", " << workers << " workers\n"
+             << "Requests: " << records.size() << " (" << total.purchases << " purchases, " << total.restocks
+             << " restocks, " << total.releases << " releases, " << total.repricings << " repricings, "
+             << total.displays << " displays)\n"
+             << "Throughput: " << records.size() / elapsed << " requests/s\n"
+             << "Purchases completed: " << total.purchased << ", revenue: $" << total.revenue << "\n"
+             << "Latency (us): p50 " << LoadGenerator::percentile(all, 50)
+             << ", p99 " << LoadGenerator::percentile(all, 99)
+             << ", p99.9 " << LoadGenerator::percentile(all, 99.9)
+             << ", max " << (all.empty() ? 0.0 : all.back()) << "\n"
+             << "Purchase latency (us): p50 " << LoadGenerator::percentile(bought, 50)
+             << ", p99 " << LoadGenerator::percentile(bought, 99)
+             << ", p99.9 " << LoadGenerator::percentile(bought, 99.9) << endl;
+    }
+
+    // Entry point for --replay
+    static int runFromCommandLine(int argc, char* argv[]) {
+        string path = CommandLineOptions::get(argc, argv, "replay", "");
+        VendingMachine machine("Replay");
+        machine.setVerbose(false);
+        if (!LoadGenerator::buildCatalog(argc, argv, machine)) return 1;
+
+        TraceReplayer replayer(machine);
+        if (!replayer.load(path)) {
+            cout << "Could not read trace file " << path << "." << endl;
+            return 1;
+        }
+        if (replayer.getProductCount() != machine.getProductCount()) {  // Added validation
+            cout << "Trace was recorded against " << replayer.getProductCount() << " products, but this catalog has "
+                 << machine.getProductCount() << ". Use the catalog options it was recorded with." << endl;
+            return 1;
+        }
+
+        SalesAnalytics analytics(60, 60);
+        machine.attachAnalytics(&analytics);
+        unique_ptr<IdempotencyTable> requests;
+        if (replayer.hasKeyedPurchases()) {
+            requests.reset(new IdempotencyTable(1 << 20, 300));
+            machine.attachIdempotencyTable(requests.get());
+        }
+
+        long workers = CommandLineOptions::getInt(argc, argv, "threads", replayer.getThreadCount());
+        double speed = CommandLineOptions::getDouble(argc, argv, "replay-speed", 0.0);
+        cout << "Replaying " << replayer.getRecordCount() << " requests from " << path << " ("
+             << replayer.getThreadCount() << " recorded threads)" << endl;
+        replayer.run(static_cast<unsigned>(max(workers, 1L)), max(speed, 0.0));
+        return 0;
+    }
+};
+
+// Allocation check - runs purchases, pricing and sale recording with operator new counted.
+// Exits non-zero if the hot path allocated anything after the catalog was loaded.
+int runAllocationCheck(int argc, char* argv[]) {
+    long purchases = CommandLineOptions::getInt(argc, argv, "purchases", 1000000);
+    int threads = CommandLineOptions::getInt(argc, argv, "threads", 4);
+    if (purchases <= 0 || threads <= 0) {  // Added validation
+        cout << "Invalid allocation check configuration." << endl;
+        return 1;
+    }
+
+    VendingMachine machine("Allocation Check");
+    machine.setVerbose(false);
+    SalesAnalytics analytics(60, 60);
+    machine.attachAnalytics(&analytics);
+    DynamicPricingEngine pricingEngine(DynamicPricingEngine::defaultConfig());
+    machine.attachPricingEngine(&pricingEngine);
+    addDefaultCatalog(machine);
+    LoadGenerator::populateCatalog(machine, 1000, 0, 42);
+
+    TopSellerTracker topSellers;
+    machine.attachTopSellers(&topSellers);
+
+    SalesTrackerConsumer trackerConsumer;
+    SalesEventBus eventBus(vector<SalesEventConsumer*>{&analytics, &trackerConsumer, &pricingEngine, &topSellers});
+    if (CommandLineOptions::has(argc, argv, "event-bus")) {
+        machine.attachEventBus(&eventBus);
+    }
+    InventoryReplicator replicator(machine);  // marking changed slots must not allocate either
+    replicator.ship();
+    IdempotencyTable requests(1 << 16, 60);  // keyed purchases, with retries, must not allocate either
+    machine.attachIdempotencyTable(&requests);
+
+    // Threads are created before counting starts; they wait for the go signal
+    atomic<bool> go(false);
+    atomic<long> sold(0);
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.push_back(thread([&machine, &go, &sold, purchases, threads, t]() {
+            while (!go.load()) {
+                this_thread::yield();
+            }
+            size_t productCount = machine.getProductCount();
+            unsigned long state = 2654435761UL * (t + 1);
+            long share = purchases / threads + (t < purchases % threads ? 1 : 0);
+            long localSold = 0;
+            for (long i = 0; i < share; ++i) {
+                state = state * 6364136223846793005UL + 1442695040888963407UL;
+                size_t index = (state >> 33) % productCount;
+                int quantity = 1 + static_cast<int>((state >> 20) % 3);
+
+                machine.restockProduct(index, quantity);
+                double itemTotal = 0.0;
+                unsigned long long requestId = (static_cast<unsigned long long>(t) + 1) << 40 | (i + 1);
+                bool bought = machine.purchaseProduct(index, quantity, itemTotal, requestId);
+                if ((state >> 60) == 0) {
+                    machine.purchaseProduct(index, quantity, itemTotal, requestId);  // retry, answered from the table
+                }
+                if (bought) {
+                    SalesTracker::recordSale(itemTotal);
+                    localSold++;
+                }
+            }
+            sold.fetch_add(localSold);
+        }));
+    }
+
+    AllocationCounter::start();
+    go.store(true);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    eventBus.flush();
+    long allocations = AllocationCounter::stop();
+
+    cout << "Purchases attempted: " << purchases << ", completed: " << sold.load()
+         << ", threads: " << threads << endl;
+    cout << "Heap allocations during purchase path: " << allocations << endl;
+    if (allocations != 0) {
+        cout << "FAILED: purchase path allocated memory." << endl;
+        return 1;
+    }
+    cout << "PASSED: purchase path is allocation-free." << endl;
+    return 0;
+}
+
+// Replication check - loses one delta batch on the way to a replica, then ships heartbeats
+// only. Exits non-zero unless the replica notices the gap and resynchronizes to the machine.
+int runReplicationCheck() {
+    VendingMachine machine("Replication Check");
+    machine.setVerbose(false);
+    machine.addProduct(new Product("Check Item", 1.0, 20));
+    LoopbackTransport outgoing, feedback;
+    InventoryReplicator replicator(machine);
+    InventoryReplica replica(outgoing, &feedback);
+    replicator.addReplica(&outgoing, &feedback);
+    replica.poll();
+
+    double itemTotal;
+    machine.purchaseProduct(0, 3, itemTotal);
+    outgoing.dropNext(1);
+    replicator.ship();  // the delta carrying the sale is lost
+    for (int heartbeat = 0; heartbeat < 5; ++heartbeat) {
+        replicator.ship();
+        replica.poll();
+    }
+
+    int machineStock = machine.getProduct(0)->getStockQuantity();
+    cout << "Machine stock: " << machineStock << ", replica stock: " << replica.getStock(0)
+         << ", synced: " << (replica.isSynced() ? "yes" : "no") << ", sequence " << replica.getSequence()
+         << "/" << replicator.getSequence() << endl;
+    if (!replica.isSynced() || replica.getStock(0) != machineStock || replica.getSequence() != replicator.getSequence()) {
+        cout << "FAILED: replica did not recover from a lost delta." << endl;
+        return 1;
+    }
+    cout << "PASSED: replica recovered from a lost delta." << endl;
+    return 0;
+}
+
+// Fixed, single-threaded workload for profile-guided builds (--pgo-train): baskets with
+// promotions and dynamic pricing, restocks, catalog repricings and displays, then a short
+// fleet simulation. It runs on the virtual clock from fixed seeds, so every training run
+// executes exactly the same code paths and produces the same profile.
+int runTrainingWorkload(int argc, char* argv[]) {
+    long baskets = CommandLineOptions::getInt(argc, argv, "baskets", 1000000);
+    if (baskets <= 0) {  // Added validation
+        cout << "Invalid training configuration." << endl;
+        return 1;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    time_t now = 1767225600;  // 2026-01-01 00:00 UTC
+    Clock::setVirtualTime(now);
+
+    VendingMachine machine("Training");
+    machine.setVerbose(false);
+    SalesAnalytics analytics(60, 60);
+    machine.attachAnalytics(&analytics);
+    DynamicPricingEngine pricingEngine(DynamicPricingEngine::defaultConfig());
+    machine.attachPricingEngine(&pricingEngine);
+    SalesSketches sketches;
+    machine.attachSketches(&sketches);
+    TopSellerTracker topSellers;
+    machine.attachTopSellers(&topSellers);
+    addDefaultCatalog(machine);
+    for (size_t i = 0; i < machine.getProductCount(); ++i) {
+        machine.restockProduct(i, 500);
+    }
+    LoadGenerator::populateCatalog(machine, 2000, 500, 42);
+
+    vector<PromotionRule> rules;
+    LoadGenerator::generateSyntheticPromotions(rules, 50, machine.getProductCount(), 42);
+    PromotionEngine promotions;
+    promotions.compile(rules, machine.getProductCategories());
+    machine.attachPromotions(&promotions);
+
+    ZipfDistribution popularity(machine.getProductCount(), 1.0);
+    mt19937_64 rng(42);
+    vector<BasketLine> basket;
+    vector<pair<size_t, double>> changes(machine.getProductCount());
+    NullStreamBuffer discard;
+    streambuf* console = cout.rdbuf(&discard);  // stock warnings and displays are formatted, not printed
+    double revenue = 0.0;
+    for (long b = 0; b < baskets; ++b) {
+        if (b % 1000 == 0) {
+            Clock::setVirtualTime(++now);
+        }
+        basket.clear();
+        double total = 0.0;
+        int lines = 1 + static_cast<int>(rng() % 4);
+        for (int i = 0; i < lines; ++i) {
+            size_t product = popularity.sample(rng);
+            int quantity = 1 + static_cast<int>(rng() % 2);
+            double itemTotal = 0.0;
+            if (machine.purchaseProduct(product, quantity, itemTotal)) {
+                total += itemTotal;
+                basket.push_back(BasketLine{product, quantity, itemTotal / quantity});
+            }
+        }
+        total -= machine.applyPromotions(basket);
+        machine.completeBasket(total, VendingMachine::countItems(basket), VendingMachine::countDistinctProducts(basket),
+                               1 + rng() % 100000);
+        revenue += total;
+
+        if (b % 20 == 0) {
+            machine.restockProduct(popularity.sample(rng), 50);
+        }
+        if (b % 50000 == 0) {
+            for (size_t i = 0; i < changes.size(); ++i) {
+                changes[i] = make_pair(i, machine.getProduct(i)->getBasePrice() * (0.95 + (rng() % 11) / 100.0));
+            }
+            machine.repriceProducts(changes);
+        }
+        if (b % 100000 == 0) {
+            machine.displayProducts();
+        }
+    }
+    cout.rdbuf(console);
+
+    FleetSimulator::Config fleet = FleetSimulator::defaultConfig();
+    fleet.machines = 20;
+    fleet.days = 30;
+    FleetSimulator::Result simulated = FleetSimulator(fleet).run();
+    Clock::useRealTime();
+
+    cout << "Training workload: " << baskets << " baskets ($" << fixed << setprecision(2) << revenue
+         << "), fleet simulation of " << simulated.events << " events" << endl;
+    cout << "Elapsed: " << setprecision(3)
+         << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (CommandLineOptions::has(argc, argv, "loadgen")) {
+        return LoadGenerator::runFromCommandLine(argc, argv);
+    }
+    if (CommandLineOptions::has(argc, argv, "alloc-check")) {
+        return runAllocationCheck(argc, argv);
+    }
+    if (CommandLineOptions::has(argc, argv, "replication-check")) {
+        return runReplicationCheck();
+    }
+    if (CommandLineOptions::has(argc, argv, "simulate")) {
+        return FleetSimulator::runFromCommandLine(argc, argv);
+    }
+    if (CommandLineOptions::has(argc, argv, "replay")) {
+        return TraceReplayer::runFromCommandLine(argc, argv);
+    }
+    if (CommandLineOptions::has(argc, argv, "pgo-train")) {
+        return runTrainingWorkload(argc, argv);
+    }
+
+    VendingMachine* machine = new VendingMachine("Smart Vending");
+    SalesAnalytics analytics(3600, 24 * 7, false);  // the session report reads categories only
+    machine->attachAnalytics(&analytics);
+    SalesSketches sketches;
+    machine->attachSketches(&sketches);
+    ReceiptPrinter receipts(cout);
+    machine->attachReceiptPrinter(&receipts);
+
+    string catalogFile = CommandLineOptions::get(argc, argv, "catalog", "");
+    if (catalogFile.empty()) {
+        addDefaultCatalog(*machine);
+    } else {
+        machine->setVerbose(false);
+        if (!CatalogLoader::loadFile(catalogFile, *machine)) {
+            delete machine;
+            return 1;
+        }
+    }
+
+    PromotionEngine promotions;
+    string promotionFile = CommandLineOptions::get(argc, argv, "promotions", "");
+    if (!promotionFile.empty()) {
+        ifstream file(promotionFile);
+        vector<PromotionRule> rules;
+        PromotionEngine::parseRules(file, rules);
+        promotions.compile(rules, machine->getProductCategories());
+        machine->attachPromotions(&promotions);
+        cout << "Loaded " << promotions.size() << " promotions from " << promotionFile << endl;
+    }
+
+    string traceFile = CommandLineOptions::get(argc, argv, "record-trace", "");
+    unique_ptr<TraceRecorder> trace;
+    if (!traceFile.empty()) {
+        trace.reset(new TraceRecorder(traceFile, machine->getProductCount()));
+        machine->attachTraceRecorder(trace.get());
+    }
+
+    string priceFile = CommandLineOptions::get(argc, argv, "prices", "");
+    if (!priceFile.empty()) {
+        CatalogLoader::loadPriceFile(priceFile, *machine);
+    }
+
+    unique_ptr<SimulatedPaymentGateway> gateway;
+    double paymentLatencyMs = CommandLineOptions::getDouble(argc, argv, "payment-latency-ms", 0.0);
+    if (paymentLatencyMs > 0) {
+        gateway.reset(new SimulatedPaymentGateway(paymentLatencyMs, 0.0,
+                                                  CommandLineOptions::getDouble(argc, argv, "decline-rate", 0.0),
+                                                  static_cast<unsigned long>(time(0))));
+        machine->attachPaymentGateway(gateway.get());
+    }
+
+    unique_ptr<ChangeMaker> cashBox;
+    if (CommandLineOptions::has(argc, argv, "cash")) {
+        cashBox.reset(new ChangeMaker(ChangeMaker::parseDenominations(
+            CommandLineOptions::get(argc, argv, "denominations", "1,5,10,25,100,500,1000,2000"))));
+        cashBox->topUp(vector<int>(cashBox->getDenominationCount(), CommandLineOptions::getInt(argc, argv, "coin-stock", 20)));
+        machine->attachCashBox(cashBox.get());
+    }
 
     cout << "\n=== Welcome to Smart Vending ===\n";
     machine->displayProducts();
@@ -361,6 +7224,10 @@ int main() {
     cout << "\n=== Sales Statistics ===\n\n";
     SalesTracker::displayTotalSales();
     SalesTracker::displayTransactionStats();
+    sketches.displayReport();
+    cout << "\nRevenue by category:" << endl;
+    time_t now = Clock::now();
+    analytics.displayCategoryReport(now - 24 * 60 * 60, now + 1);
 
     delete machine;
     return 0;